@@ -3,6 +3,17 @@
 #pragma once
 
 #include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NEGENTROPY_X86_KERNELS 1
+#endif
 
 #include <string>
 #include <string_view>
@@ -12,6 +23,22 @@
 #include <limits>
 #include <algorithm>
 #include <stdexcept>
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <fstream>
+#include <thread>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <array>
+#include <optional>
+#include <random>
+#include <variant>
+#include <type_traits>
+#include <tuple>
+#include <cmath>
 
 
 
@@ -22,12 +49,186 @@ const uint64_t MAX_U64 = std::numeric_limits<uint64_t>::max();
 using err = std::runtime_error;
 
 
-struct alignas(16) XorElem {
+// Normalized key: the first 8 bytes of an id as a big-endian integer, so that comparing keys
+// gives the same order as comparing the bytes. Ids are always at least 8 bytes (zero-padded).
+
+inline uint64_t loadIdKey(const char *p) {
+    uint64_t k;
+    memcpy(&k, p, 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    k = __builtin_bswap64(k);
+#endif
+    return k;
+}
+
+
+// Range-fingerprint kernels: XOR n ids packed at idSize bytes each into accum (idSize bytes). When idSize
+// divides 32, the ids tile a 32-byte period, so the run is XORed as one byte stream into 4 independent
+// accumulators and folded down to idSize at the end. Other sizes use a per-id loop.
+
+namespace kernels {
+
+using XorPackedIdsFn = void (*)(char *accum, const char *p, uint64_t n, uint64_t idSize);
+
+inline void xorFold(char *accum, const char *buf, uint64_t bufSize, uint64_t idSize) {
+    for (uint64_t off = 0; off < bufSize; off += idSize) {
+        for (uint64_t j = 0; j < idSize; j++) accum[j] ^= buf[off + j];
+    }
+}
+
+inline void xorPackedIdsPortable(char *accum, const char *p, uint64_t n, uint64_t idSize) {
+    uint64_t bytes = n * idSize, i = 0;
+
+    if (32 % idSize == 0) {
+        uint64_t acc[4] = {};
+        for (; i + 32 <= bytes; i += 32) {
+            uint64_t w[4];
+            memcpy(w, p + i, 32);
+            for (int k = 0; k < 4; k++) acc[k] ^= w[k];
+        }
+        xorFold(accum, reinterpret_cast<const char *>(acc), 32, idSize);
+    }
+
+    xorFold(accum, p + i, bytes - i, idSize);
+}
+
+#ifdef NEGENTROPY_X86_KERNELS
+
+__attribute__((target("sse2")))
+inline void xorPackedIdsSse2(char *accum, const char *p, uint64_t n, uint64_t idSize) {
+    if (32 % idSize != 0) return xorPackedIdsPortable(accum, p, n, idSize);
+
+    uint64_t bytes = n * idSize, i = 0;
+    __m128i a0 = _mm_setzero_si128(), a1 = a0, a2 = a0, a3 = a0;
+
+    for (; i + 64 <= bytes; i += 64) {
+        a0 = _mm_xor_si128(a0, _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i)));
+        a1 = _mm_xor_si128(a1, _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i + 16)));
+        a2 = _mm_xor_si128(a2, _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i + 32)));
+        a3 = _mm_xor_si128(a3, _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i + 48)));
+    }
+
+    char buf[64];
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(buf), a0);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(buf + 16), a1);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(buf + 32), a2);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(buf + 48), a3);
+    xorFold(accum, buf, 64, idSize);
+
+    xorFold(accum, p + i, bytes - i, idSize);
+}
+
+__attribute__((target("avx2")))
+inline void xorPackedIdsAvx2(char *accum, const char *p, uint64_t n, uint64_t idSize) {
+    if (32 % idSize != 0) return xorPackedIdsPortable(accum, p, n, idSize);
+
+    uint64_t bytes = n * idSize, i = 0;
+    __m256i a0 = _mm256_setzero_si256(), a1 = a0, a2 = a0, a3 = a0;
+
+    for (; i + 128 <= bytes; i += 128) {
+        a0 = _mm256_xor_si256(a0, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i)));
+        a1 = _mm256_xor_si256(a1, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i + 32)));
+        a2 = _mm256_xor_si256(a2, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i + 64)));
+        a3 = _mm256_xor_si256(a3, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i + 96)));
+    }
+
+    for (; i + 32 <= bytes; i += 32) a0 = _mm256_xor_si256(a0, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i)));
+
+    char buf[32];
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(buf), _mm256_xor_si256(_mm256_xor_si256(a0, a1), _mm256_xor_si256(a2, a3)));
+    xorFold(accum, buf, 32, idSize);
+
+    xorFold(accum, p + i, bytes - i, idSize);
+}
+
+__attribute__((target("avx512f")))
+inline void xorPackedIdsAvx512(char *accum, const char *p, uint64_t n, uint64_t idSize) {
+    if (32 % idSize != 0) return xorPackedIdsPortable(accum, p, n, idSize);
+
+    uint64_t bytes = n * idSize, i = 0;
+    __m512i a0 = _mm512_setzero_si512(), a1 = a0, a2 = a0, a3 = a0;
+
+    for (; i + 256 <= bytes; i += 256) {
+        a0 = _mm512_xor_si512(a0, _mm512_loadu_si512(p + i));
+        a1 = _mm512_xor_si512(a1, _mm512_loadu_si512(p + i + 64));
+        a2 = _mm512_xor_si512(a2, _mm512_loadu_si512(p + i + 128));
+        a3 = _mm512_xor_si512(a3, _mm512_loadu_si512(p + i + 192));
+    }
+
+    for (; i + 64 <= bytes; i += 64) a0 = _mm512_xor_si512(a0, _mm512_loadu_si512(p + i));
+
+    char buf[64];
+    _mm512_storeu_si512(buf, _mm512_xor_si512(_mm512_xor_si512(a0, a1), _mm512_xor_si512(a2, a3)));
+    xorFold(accum, buf, 64, idSize);
+
+    xorFold(accum, p + i, bytes - i, idSize);
+}
+
+#endif
+
+// The widest variant this CPU supports. NEGENTROPY_XOR_KERNEL=portable|sse2|avx2 caps it, for testing.
+
+inline XorPackedIdsFn selectXorPackedIds() {
+    const char *cap = ::getenv("NEGENTROPY_XOR_KERNEL");
+    std::string_view name = cap ? cap : "";
+
+    if (name == "portable") return xorPackedIdsPortable;
+
+#ifdef NEGENTROPY_X86_KERNELS
+    __builtin_cpu_init();
+
+    if (name != "sse2" && name != "avx2" && __builtin_cpu_supports("avx512f")) return xorPackedIdsAvx512;
+    if (name != "sse2" && __builtin_cpu_supports("avx2")) return xorPackedIdsAvx2;
+    return xorPackedIdsSse2;
+#else
+    return xorPackedIdsPortable;
+#endif
+}
+
+// Selected on first use rather than during static initialization, so that fingerprints computed by other static
+// initializers (in any translation unit) don't call a kernel that hasn't been chosen yet
+
+inline void xorPackedIds(char *accum, const char *p, uint64_t n, uint64_t idSize) {
+    static const XorPackedIdsFn kernel = selectXorPackedIds();
+    kernel(accum, p, n, idSize);
+}
+
+// Number of leading bytes that are equal in a and b, both of which must have 32 readable bytes.
+// SSE2 is part of x86-64, so this needs no dispatch.
+
+inline uint64_t sharedPrefix32(const char *a, const char *b) {
+#ifdef __SSE2__
+    __m128i lo = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a)), _mm_loadu_si128(reinterpret_cast<const __m128i *>(b)));
+    __m128i hi = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a + 16)), _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + 16)));
+    uint32_t differ = ~(uint32_t(_mm_movemask_epi8(lo)) | uint32_t(_mm_movemask_epi8(hi)) << 16);
+    return differ ? __builtin_ctz(differ) : 32;
+#else
+    for (uint64_t i = 0; i < 32; i += 8) {
+        uint64_t x, y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        if (x != y) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            return i + __builtin_ctzll(x ^ y) / 8;
+#else
+            return i + __builtin_clzll(x ^ y) / 8;
+#endif
+        }
+    }
+    return 32;
+#endif
+}
+
+}
+
+
+struct XorElem {
     uint64_t timestamp;
+    uint64_t idKey; // loadIdKey(id): most comparisons are decided by (timestamp, idKey)
     uint64_t idSize;
-    char id[32];
+    char id[32]; // bytes past idSize are always zero, so whole arrays can be compared
 
-    XorElem() : timestamp(0), idSize(32) {
+    XorElem() : timestamp(0), idKey(0), idSize(32) {
         memset(id, '\0', sizeof(id));
     }
 
@@ -35,9 +236,10 @@ struct alignas(16) XorElem {
         if (idSize > 32) throw negentropy::err("id too big");
         memset(id, '\0', sizeof(id));
         memcpy(id, id_.data(), idSize);
+        idKey = loadIdKey(id);
     }
 
-    XorElem(uint64_t timestamp, uint64_t idSize) : timestamp(timestamp), idSize(idSize) {
+    XorElem(uint64_t timestamp, uint64_t idSize) : timestamp(timestamp), idKey(0), idSize(idSize) {
         if (idSize > 32) throw negentropy::err("id too big");
         memset(id, '\0', sizeof(id));
     }
@@ -51,368 +253,3403 @@ struct alignas(16) XorElem {
     }
 
     XorElem& operator^=(const XorElem &other) {
-        auto *p1 = static_cast<unsigned char *>(__builtin_assume_aligned(id, 16));
-        auto *p2 = static_cast<unsigned char *>(__builtin_assume_aligned(other.id, 16));
-        for (size_t i = 0; i < 32; i++) p1[i] ^= p2[i];
+        for (size_t i = 0; i < 32; i += 8) {
+            uint64_t a, b;
+            memcpy(&a, id + i, 8);
+            memcpy(&b, other.id + i, 8);
+            a ^= b;
+            memcpy(id + i, &a, 8);
+        }
+        idKey ^= other.idKey;
         return *this;
     }
 
+    void xorBytes(const char *p, size_t n) {
+        for (size_t i = 0; i < n; i++) id[i] ^= p[i];
+        idKey = loadIdKey(id);
+    }
+
     bool operator==(const XorElem &other) const {
-        return timestamp == other.timestamp && getId() == other.getId();
+        return timestamp == other.timestamp && idKey == other.idKey && idSize == other.idSize && kernels::sharedPrefix32(id, other.id) == 32;
     }
 };
 
 inline bool operator<(const XorElem &a, const XorElem &b) {
-    return a.timestamp != b.timestamp ? a.timestamp < b.timestamp : a.getId() < b.getId();
+    if (a.timestamp != b.timestamp) return a.timestamp < b.timestamp;
+    if (a.idKey != b.idKey) return a.idKey < b.idKey;
+
+    // Same order as comparing getId()s: the zero padding sorts a prefix before any longer id, and
+    // ids equal up to the padding are ordered by size
+    uint64_t shared = kernels::sharedPrefix32(a.id, b.id);
+    if (shared == 32) return a.idSize < b.idSize;
+    return uint8_t(a.id[shared]) < uint8_t(b.id[shared]);
 };
 
 
-struct Negentropy {
-    uint64_t idSize;
+struct StorageBase {
+    virtual ~StorageBase() {}
 
-    struct BoundOutput {
-        XorElem start;
-        XorElem end;
-        std::string payload;
-    };
+    // Items are addressed by their index in (timestamp, id) order
 
-    std::vector<XorElem> items;
-    bool sealed = false;
-    bool isInitiator = false;
-    uint64_t frameSizeLimit = 0;
-    std::deque<BoundOutput> pendingOutputs;
+    virtual uint64_t size() const = 0;
+    virtual XorElem getItem(uint64_t i) const = 0;
+    virtual void iterate(uint64_t begin, uint64_t end, const std::function<void(const XorElem &, uint64_t)> &cb) const = 0;
+    virtual uint64_t findUpperBound(uint64_t begin, uint64_t end, const XorElem &bound) const = 0;
+    virtual XorElem fingerprint(uint64_t begin, uint64_t end) const = 0;
 
-    Negentropy(uint64_t idSize) : idSize(idSize) {
-        if (idSize < 8 || idSize > 32) throw negentropy::err("idSize invalid");
+    // Changes whenever items are added or removed, so that remembered item indices can be revalidated
+    virtual uint64_t generation() const {
+        return 0;
     }
 
-    void addItem(uint64_t createdAt, std::string_view id) {
-        if (sealed) throw negentropy::err("already sealed");
-
-        items.emplace_back(createdAt, id);
+    // The ids of items [begin, end) if they are stored contiguously at exactly idSize bytes each, so they can be
+    // referenced in place, or empty. Valid until the storage is modified.
+    virtual std::string_view packedIds(uint64_t, uint64_t, uint64_t) const {
+        return {};
     }
+};
 
-    void seal() {
-        if (sealed) throw negentropy::err("already sealed");
 
-        std::reverse(items.begin(), items.end()); // typically pushed in approximately descending order so this may speed up the sort
-        std::sort(items.begin(), items.end());
-        sealed = true;
+struct SealOptions {
+    uint64_t fingerprintIndexStride = 0; // 0 = no index, 1 = full prefix-XOR array, K = one entry every K items
+    bool dedup = false; // drop identical items, which would otherwise cancel each other out of fingerprints
+    unsigned numThreads = 0; // 0 = std::thread::hardware_concurrency()
+    bool searchIndex = true; // build a storage::SearchIndex for bound lookups
+};
+
+
+namespace storage {
+
+
+// Cache-friendly index for timestamp lookups: every Stride-th timestamp, stored in Eytzinger (BFS) order
+// as a perfect binary tree padded with MAX_U64. The top levels stay in cache, each probe prefetches the
+// cache line holding the node's descendants 3 levels down, and the search loop has no unpredictable branches.
+
+struct SearchIndex {
+    static const uint64_t Stride = 16;
+
+    struct alignas(64) Line {
+        uint64_t keys[8];
+    };
+
+    std::vector<Line> lines; // node k (1-based) is key k of the concatenated lines
+    uint64_t height = 0;
+
+    void build(const uint64_t *timestamps, uint64_t numItems) {
+        uint64_t numSamples = (numItems + Stride - 1) / Stride;
+
+        height = 0;
+        while ((uint64_t(1) << height) <= numSamples) height++;
+        lines.assign(std::max(numNodes() / 8, uint64_t(1)), Line{});
+
+        uint64_t next = 0;
+        fill(1, timestamps, numSamples, next);
     }
 
-    std::string initiate(uint64_t frameSizeLimit_ = 0) {
-        if (!sealed) throw negentropy::err("not sealed");
-        isInitiator = true;
+    // Index of the first item with a timestamp >= ts
+    uint64_t lowerBound(const uint64_t *timestamps, uint64_t numItems, uint64_t ts) const {
+        const uint64_t *keys = reinterpret_cast<const uint64_t *>(lines.data());
+        uint64_t mask = numNodes() - 1;
+        uint64_t k = 1;
 
-        if (frameSizeLimit_ != 0 && frameSizeLimit_ < 1024) throw negentropy::err("frameSizeLimit too small");
-        frameSizeLimit = frameSizeLimit_;
+        for (uint64_t i = 0; i < height; i++) {
+            __builtin_prefetch(keys + ((k * 8) & mask));
+            k = 2 * k + (keys[k] < ts);
+        }
 
-        splitRange(items.begin(), items.end(), XorElem(0, ""), XorElem(MAX_U64, ""), pendingOutputs);
+        // k is now a leaf position, and k - numNodes() is the number of samples < ts
 
-        return buildOutput();
+        uint64_t sample = std::min(k - numNodes(), (numItems + Stride - 1) / Stride);
+        uint64_t lower = sample ? (sample - 1) * Stride + 1 : 0;
+        uint64_t upper = std::min(sample * Stride, numItems);
+
+        return std::lower_bound(timestamps + lower, timestamps + upper, ts) - timestamps;
     }
 
-    std::string reconcile(std::string_view query) {
-        if (isInitiator) throw negentropy::err("initiator not asking for have/need IDs");
-        std::vector<std::string> haveIds, needIds;
-        reconcileAux(query, haveIds, needIds);
-        return buildOutput();
+  private:
+    uint64_t numNodes() const {
+        return uint64_t(1) << height;
     }
 
-    std::string reconcile(std::string_view query, std::vector<std::string> &haveIds, std::vector<std::string> &needIds) {
-        if (!isInitiator) throw negentropy::err("non-initiator asking for have/need IDs");
-        reconcileAux(query, haveIds, needIds);
-        return buildOutput();
+    void fill(uint64_t k, const uint64_t *timestamps, uint64_t numSamples, uint64_t &next) {
+        if (k >= numNodes()) return;
+
+        fill(2 * k, timestamps, numSamples, next);
+        reinterpret_cast<uint64_t *>(lines.data())[k] = next < numSamples ? timestamps[next * Stride] : MAX_U64;
+        next++;
+        fill(2 * k + 1, timestamps, numSamples, next);
     }
+};
 
-  private:
-    void reconcileAux(std::string_view query, std::vector<std::string> &haveIds, std::vector<std::string> &needIds) {
-        if (!sealed) throw negentropy::err("not sealed");
 
-        auto prevBound = XorElem(0, "");
-        auto prevIndex = items.begin();
-        uint64_t lastTimestampIn = 0;
-        std::deque<BoundOutput> outputs;
+// XOR n ids packed at exactly idSize bytes each into output
 
-        while (query.size()) {
-            auto currBound = decodeBound(query, lastTimestampIn);
-            auto mode = decodeVarInt(query); // 0 = Skip, 1 = Fingerprint, 2 = IdList, 3 = IdListResponse
+inline void xorPackedIds(XorElem &output, const char *p, uint64_t n, uint64_t idSize) {
+    char accum[32] = {};
+    kernels::xorPackedIds(accum, p, n, idSize);
+    output.xorBytes(accum, idSize);
+}
 
-            auto lower = prevIndex;
-            auto upper = std::upper_bound(prevIndex, items.end(), currBound);
 
-            if (mode == 0) { // Skip
-                // Do nothing
-            } else if (mode == 1) { // Fingerprint
-                XorElem theirXorSet(0, getBytes(query, idSize));
+// Read-only view of sealed, sorted columns: timestamps, ids packed at exactly idSize bytes each, and an optional
+// prefix-XOR index. Shared by Vector (which owns its columns) and Snapshot (which maps them from a file).
 
-                XorElem ourXorSet;
-                for (auto i = lower; i < upper; ++i) ourXorSet ^= *i;
+struct ColumnView {
+    uint64_t idSize = 0;
+    uint64_t numItems = 0;
+    const uint64_t *timestamps = nullptr;
+    const char *ids = nullptr;
+    const char *fingerprintIndex = nullptr; // entry k (idSize bytes) is the XOR of items [0, k * fingerprintIndexStride)
+    uint64_t fingerprintIndexStride = 0;
+    const SearchIndex *searchIndex = nullptr;
 
-                if (theirXorSet.getId() != ourXorSet.getId(idSize)) {
-                    splitRange(lower, upper, prevBound, currBound, outputs);
-                }
-            } else if (mode == 2) { // IdList
-                auto numIds = decodeVarInt(query);
+    static const uint64_t MaxGallopStep = 64;
 
-                struct TheirElem {
-                    uint64_t offset;
-                    bool onBothSides;
-                };
+    static uint64_t fingerprintIndexEntries(uint64_t numItems, uint64_t stride) {
+        return stride ? numItems / stride + 1 : 0;
+    }
 
-                std::unordered_map<std::string, TheirElem> theirElems;
-                for (uint64_t i = 0; i < numIds; i++) {
-                    auto e = getBytes(query, idSize);
-                    theirElems.emplace(e, TheirElem{i, false});
-                }
+    std::string_view getId(uint64_t i) const {
+        return std::string_view(ids + i * idSize, idSize);
+    }
 
-                std::vector<std::string> responseHaveIds;
-                std::vector<uint64_t> responseNeedIndices;
+    XorElem getItem(uint64_t i) const {
+        if (i >= numItems) throw negentropy::err("item index out of range");
+        return XorElem(timestamps[i], getId(i));
+    }
 
-                for (auto it = lower; it < upper; ++it) {
-                    auto e = theirElems.find(std::string(it->getId()));
+    void iterate(uint64_t begin, uint64_t end, const std::function<void(const XorElem &, uint64_t)> &cb) const {
+        for (auto i = begin; i < end; i++) cb(XorElem(timestamps[i], getId(i)), i);
+    }
 
-                    if (e == theirElems.end()) {
-                        // ID exists on our side, but not their side
-                        if (isInitiator) haveIds.emplace_back(it->getId());
-                        else responseHaveIds.emplace_back(it->getId());
-                    } else {
-                        // ID exists on both sides
-                        e->second.onBothSides = true;
-                    }
-                }
+    std::string_view packedIds(uint64_t begin, uint64_t end, uint64_t idSize_) const {
+        if (idSize_ != idSize || begin > end || end > numItems) return {};
+        return std::string_view(ids + begin * idSize, (end - begin) * idSize);
+    }
 
-                for (const auto &[k, v] : theirElems) {
-                    if (!v.onBothSides) {
-                        // ID exists on their side, but not our side
-                        if (isInitiator) needIds.emplace_back(k);
-                        else responseNeedIndices.emplace_back(v.offset);
-                    }
-                }
+    uint64_t findUpperBound(uint64_t begin, uint64_t end, const XorElem &bound) const {
+        // Search the timestamp column, then only compare ids among items with the bound's timestamp
+        auto lower = timestampLowerBound(begin, end, bound.timestamp);
+        auto upper = bound.timestamp == MAX_U64 ? end : timestampLowerBound(lower, end, bound.timestamp + 1);
+
+        auto boundId = bound.getId();
+        while (lower < upper) {
+            auto mid = lower + (upper - lower) / 2;
+            uint64_t midKey = loadIdKey(ids + mid * idSize);
+            if (bound.idKey != midKey ? bound.idKey < midKey : boundId < getId(mid)) upper = mid;
+            else lower = mid + 1;
+        }
 
-                if (!isInitiator) {
-                    std::string payload = encodeVarInt(3); // mode = IdListResponse
+        return lower;
+    }
 
-                    payload += encodeVarInt(responseHaveIds.size());
-                    for (const auto &id : responseHaveIds) payload += id;
+    XorElem fingerprint(uint64_t begin, uint64_t end) const {
+        XorElem output;
 
-                    auto bitField = encodeBitField(responseNeedIndices);
-                    payload += encodeVarInt(bitField.size());
-                    payload += bitField;
+        if (fingerprintIndexStride == 0 || end - begin <= fingerprintIndexStride) {
+            xorIds(output, begin, end);
+        } else {
+            xorPrefix(output, begin);
+            xorPrefix(output, end);
+        }
 
-                    outputs.emplace_back(BoundOutput({ prevBound, currBound, std::move(payload) }));
-                }
-            } else if (mode == 3) { // IdListResponse
-                if (!isInitiator) throw negentropy::err("unexpected IdListResponse");
+        return output;
+    }
 
-                auto numIds = decodeVarInt(query);
-                for (uint64_t i = 0; i < numIds; i++) {
-                    needIds.emplace_back(getBytes(query, idSize));
-                }
+    void xorIds(XorElem &output, uint64_t begin, uint64_t end) const {
+        xorPackedIds(output, ids + begin * idSize, end - begin, idSize);
+    }
 
-                auto bitFieldSize = decodeVarInt(query);
-                auto bitField = getBytes(query, bitFieldSize);
+    // Bounds in a message are ascending and usually close together, so gallop forwards from begin
+    // before falling back to the search index (or a plain binary search if there is none)
 
-                for (auto it = lower; it < upper; ++it) {
-                    if (bitFieldLookup(bitField, it - lower)) haveIds.emplace_back(it->getId());
-                }
-            } else {
-                throw negentropy::err("unexpected mode");
-            }
+    uint64_t timestampLowerBound(uint64_t begin, uint64_t end, uint64_t ts) const {
+        if (begin >= end || timestamps[begin] >= ts) return begin;
 
-            prevIndex = upper;
-            prevBound = currBound;
-        }
+        uint64_t lower = begin; // timestamps[lower] < ts
 
-        while (outputs.size()) {
-            pendingOutputs.emplace_front(std::move(outputs.back()));
-            outputs.pop_back();
+        for (uint64_t step = 1; step <= MaxGallopStep; step *= 2) {
+            uint64_t probe = lower + step;
+            if (probe >= end || timestamps[probe] >= ts) return std::lower_bound(timestamps + lower + 1, timestamps + std::min(probe, end), ts) - timestamps;
+            lower = probe;
         }
+
+        if (searchIndex) return std::clamp(searchIndex->lowerBound(timestamps, numItems, ts), lower + 1, end);
+
+        return std::lower_bound(timestamps + lower + 1, timestamps + end, ts) - timestamps;
     }
 
-    void splitRange(std::vector<XorElem>::iterator lower, std::vector<XorElem>::iterator upper, const XorElem &lowerBound, const XorElem &upperBound, std::deque<BoundOutput> &outputs) {
-        uint64_t numElems = upper - lower;
-        const uint64_t buckets = 16;
+  private:
+    void xorPrefix(XorElem &output, uint64_t n) const {
+        uint64_t entry = n / fingerprintIndexStride;
+        output.xorBytes(fingerprintIndex + entry * idSize, idSize);
+        xorIds(output, entry * fingerprintIndexStride, n);
+    }
+};
 
-        if (numElems < buckets * 2) {
-            std::string payload = encodeVarInt(2); // mode = IdList
-            payload += encodeVarInt(numElems);
-            for (auto it = lower; it < upper; ++it) payload += it->getId(idSize);
 
-            outputs.emplace_back(BoundOutput({ lowerBound, upperBound, std::move(payload) }));
-        } else {
-            uint64_t itemsPerBucket = numElems / buckets;
-            uint64_t bucketsWithExtra = numElems % buckets;
-            auto curr = lower;
-            XorElem prevBound = *curr;
-
-            for (uint64_t i = 0; i < buckets; i++) {
-                XorElem ourXorSet;
-                for (auto bucketEnd = curr + itemsPerBucket + (i < bucketsWithExtra ? 1 : 0); curr != bucketEnd; curr++) {
-                    ourXorSet ^= *curr;
-                }
+// Struct-of-arrays store: a timestamp column and a packed column of exactly idSize bytes per item
+
+struct Vector : StorageBase {
+    uint64_t idSize;
+    std::vector<uint64_t> timestamps;
+    std::string ids;
+    std::string fingerprintIndex;
+    uint64_t fingerprintIndexStride = 0;
+    SearchIndex searchIndex;
+    bool useSearchIndex = false;
+    bool sealed = false;
 
-                std::string payload = encodeVarInt(1); // mode = Fingerprint
-                payload += ourXorSet.getId(idSize);
+    Vector(uint64_t idSize) : idSize(idSize) {
+        if (idSize < 8 || idSize > 32) throw negentropy::err("idSize invalid");
+    }
 
-                outputs.emplace_back(BoundOutput({
-                    i == 0 ? lowerBound : prevBound,
-                    getMinimalBound(*std::prev(curr), *curr),
-                    std::move(payload)
-                }));
+    void addItem(uint64_t createdAt, std::string_view id) {
+        if (sealed) throw negentropy::err("already sealed");
+        if (id.size() > 32) throw negentropy::err("id too big");
+        if (id.size() < idSize) throw negentropy::err("id too small");
 
-                prevBound = outputs.back().end;
-            }
+        timestamps.push_back(createdAt);
+        ids.append(id.data(), idSize);
+    }
 
-            outputs.back().end = upperBound;
-        }
+    void seal(uint64_t fingerprintIndexStride_ = 0) {
+        seal(SealOptions{ fingerprintIndexStride_ });
     }
 
-    std::string buildOutput() {
-        std::string output;
-        auto currBound = XorElem(0, "");
-        uint64_t lastTimestampOut = 0;
+    void seal(const SealOptions &opts) {
+        if (sealed) throw negentropy::err("already sealed");
 
-        while (pendingOutputs.size()) {
-            std::string o;
+        sortItems(opts);
 
-            auto &p = pendingOutputs.front();
-            if (p.start < currBound) break;
+        fingerprintIndexStride = opts.fingerprintIndexStride;
+        if (fingerprintIndexStride) buildFingerprintIndex();
 
-            if (currBound != p.start) {
-                o += encodeBound(p.start, lastTimestampOut);
-                o += encodeVarInt(0); // mode = Skip
-            }
+        useSearchIndex = opts.searchIndex;
+        if (useSearchIndex) searchIndex.build(timestamps.data(), timestamps.size());
+
+        sealed = true;
+    }
 
-            o += encodeBound(p.end, lastTimestampOut);
-            o += p.payload;
+    // The Vector must not be accessed until the returned future is ready
+    std::future<void> sealAsync(const SealOptions &opts = SealOptions()) {
+        return std::async(std::launch::async, [this, opts]{ seal(opts); });
+    }
 
-            if (frameSizeLimit && output.size() + o.size() > frameSizeLimit) break;
-            output += o;
+    ColumnView view() const {
+        if (!sealed) throw negentropy::err("not sealed");
+        return ColumnView{ idSize, timestamps.size(), timestamps.data(), ids.data(), fingerprintIndex.data(), fingerprintIndexStride, useSearchIndex ? &searchIndex : nullptr };
+    }
 
-            pendingOutputs.pop_front();
+    // Writes a snapshot file that can later be opened with storage::Snapshot
+    void writeSnapshot(const std::string &path) const;
 
-            currBound = p.end;
-        }
+    uint64_t size() const override {
+        return view().numItems;
+    }
 
-        return output;
+    XorElem getItem(uint64_t i) const override {
+        return view().getItem(i);
     }
 
-    // Decoding
+    void iterate(uint64_t begin, uint64_t end, const std::function<void(const XorElem &, uint64_t)> &cb) const override {
+        view().iterate(begin, end, cb);
+    }
+
+    uint64_t findUpperBound(uint64_t begin, uint64_t end, const XorElem &bound) const override {
+        return view().findUpperBound(begin, end, bound);
+    }
+
+    XorElem fingerprint(uint64_t begin, uint64_t end) const override {
+        return view().fingerprint(begin, end);
+    }
+
+    std::string_view packedIds(uint64_t begin, uint64_t end, uint64_t idSize_) const override {
+        return view().packedIds(begin, end, idSize_);
+    }
+
+  private:
+    static const uint64_t MinItemsPerSortThread = 1 << 16;
 
-    std::string getBytes(std::string_view &encoded, size_t n) {
-        if (encoded.size() < n) throw negentropy::err("parse ends prematurely");
-        auto res = encoded.substr(0, n);
-        encoded = encoded.substr(n);
-        return std::string(res);
+    struct SortRecord {
+        uint64_t timestamp;
+        uint64_t idKey;
+        uint64_t index;
     };
 
-    uint64_t decodeVarInt(std::string_view &encoded) {
-        uint64_t res = 0;
+    bool sortLess(const SortRecord &a, const SortRecord &b) const {
+        if (a.timestamp != b.timestamp) return a.timestamp < b.timestamp;
+        if (a.idKey != b.idKey) return a.idKey < b.idKey;
+        return memcmp(ids.data() + a.index * idSize + 8, ids.data() + b.index * idSize + 8, idSize - 8) < 0;
+    }
 
-        while (1) {
-            if (encoded.size() == 0) throw negentropy::err("premature end of varint");
-            uint64_t byte = encoded[0];
-            encoded = encoded.substr(1);
-            res = (res << 7) | (byte & 0b0111'1111);
-            if ((byte & 0b1000'0000) == 0) break;
+    static void parallelFor(unsigned numThreads, uint64_t n, const std::function<void(uint64_t, uint64_t)> &fn) {
+        std::vector<std::thread> threads;
+
+        for (unsigned t = 0; t < numThreads; t++) {
+            uint64_t begin = n * t / numThreads, end = n * (t + 1) / numThreads;
+            if (t == numThreads - 1) fn(begin, end);
+            else threads.emplace_back(fn, begin, end);
         }
 
-        return res;
+        for (auto &t : threads) t.join();
     }
 
-    uint64_t decodeTimestampIn(std::string_view &encoded, uint64_t &lastTimestampIn) {
-        uint64_t timestamp = decodeVarInt(encoded);
-        timestamp = timestamp == 0 ? MAX_U64 : timestamp - 1;
-        timestamp += lastTimestampIn;
-        if (timestamp < lastTimestampIn) timestamp = MAX_U64; // saturate
-        lastTimestampIn = timestamp;
-        return timestamp;
+    bool columnsSorted() const {
+        for (uint64_t i = 1; i < timestamps.size(); i++) {
+            if (timestamps[i - 1] != timestamps[i]) {
+                if (timestamps[i - 1] > timestamps[i]) return false;
+            } else if (memcmp(ids.data() + (i - 1) * idSize, ids.data() + i * idSize, idSize) > 0) {
+                return false;
+            }
+        }
+
+        return true;
     }
 
-    XorElem decodeBound(std::string_view &encoded, uint64_t &lastTimestampIn) {
-        auto timestamp = decodeTimestampIn(encoded, lastTimestampIn);
-        auto len = decodeVarInt(encoded);
-        return XorElem(timestamp, getBytes(encoded, len));
+    void sortItems(const SealOptions &opts) {
+        uint64_t n = timestamps.size();
+
+        if (!opts.dedup && columnsSorted()) return; // for example when merging sealed levels
+
+        unsigned numThreads = opts.numThreads ? opts.numThreads : std::max(1U, std::thread::hardware_concurrency());
+        numThreads = std::max(uint64_t(1), std::min(uint64_t(numThreads), n / MinItemsPerSortThread));
+
+        std::vector<SortRecord> records(n);
+
+        parallelFor(numThreads, n, [&](uint64_t begin, uint64_t end){
+            for (auto i = begin; i < end; i++) records[i] = { timestamps[i], loadIdKey(ids.data() + i * idSize), i };
+        });
+
+        auto less = [&](const SortRecord &a, const SortRecord &b){ return sortLess(a, b); };
+
+        // Items are typically pushed in approximately descending order, and are often already sorted
+        // when loaded from a database index, so check for both before doing any real work
+
+        if (!std::is_sorted(records.begin(), records.end(), less)) {
+            if (std::is_sorted(records.rbegin(), records.rend(), less)) std::reverse(records.begin(), records.end());
+            else parallelSort(records, numThreads);
+        }
+
+        gatherItems(records, opts.dedup, numThreads);
     }
 
+    // Each thread radix sorts one chunk, then chunks are merged pairwise, in parallel, until one remains
 
-    // Encoding
+    void parallelSort(std::vector<SortRecord> &records, unsigned numThreads) {
+        uint64_t n = records.size();
+        std::vector<SortRecord> buffer(n);
+
+        std::vector<uint64_t> chunks;
+        for (unsigned t = 0; t <= numThreads; t++) chunks.push_back(n * t / numThreads);
+
+        parallelFor(numThreads, numThreads, [&](uint64_t begin, uint64_t end){
+            for (auto c = begin; c < end; c++) radixSort(records.data() + chunks[c], buffer.data() + chunks[c], chunks[c + 1] - chunks[c]);
+        });
 
-    std::string encodeVarInt(uint64_t n) {
-        if (n == 0) return std::string(1, '\0');
+        auto less = [&](const SortRecord &a, const SortRecord &b){ return sortLess(a, b); };
 
-        std::string o;
+        for (uint64_t width = 1; width < numThreads; width *= 2) {
+            uint64_t numMerges = (numThreads + 2 * width - 1) / (2 * width);
 
-        while (n) {
-            o.push_back(static_cast<unsigned char>(n & 0x7F));
-            n >>= 7;
+            parallelFor(numMerges, numMerges, [&](uint64_t begin, uint64_t end){
+                for (auto m = begin; m < end; m++) {
+                    uint64_t lo = chunks[m * 2 * width];
+                    uint64_t mid = chunks[std::min(uint64_t(numThreads), m * 2 * width + width)];
+                    uint64_t hi = chunks[std::min(uint64_t(numThreads), m * 2 * width + 2 * width)];
+                    std::merge(records.begin() + lo, records.begin() + mid, records.begin() + mid, records.begin() + hi, buffer.begin() + lo, less);
+                }
+            });
+
+            std::swap(records, buffer);
         }
+    }
+
+    // LSD radix sort on (timestamp, idKey), skipping digits that are the same for every record
+    // (for instance the high bytes of timestamps). Runs that tie on both are then sorted by full id.
 
-        std::reverse(o.begin(), o.end());
+    void radixSort(SortRecord *records, SortRecord *buffer, uint64_t n) {
+        if (n < 2) return;
 
-        for (size_t i = 0; i < o.size() - 1; i++) {
-            o[i] |= 0x80;
+        auto digit = [](const SortRecord &r, unsigned d){
+            return d < 8 ? (r.idKey >> (8 * d)) & 0xFF : (r.timestamp >> (8 * (d - 8))) & 0xFF;
+        };
+
+        std::vector<uint64_t> counts(16 * 256);
+
+        for (uint64_t i = 0; i < n; i++) {
+            for (unsigned d = 0; d < 16; d++) counts[d * 256 + digit(records[i], d)]++;
         }
 
-        return o;
-    }
+        SortRecord *src = records, *dst = buffer;
 
-    std::string encodeTimestampOut(uint64_t timestamp, uint64_t &lastTimestampOut) {
-        if (timestamp == MAX_U64) {
-            lastTimestampOut = MAX_U64;
-            return encodeVarInt(0);
+        for (unsigned d = 0; d < 16; d++) {
+            uint64_t *c = counts.data() + d * 256;
+            if (c[digit(src[0], d)] == n) continue;
+
+            uint64_t offset = 0;
+            for (unsigned b = 0; b < 256; b++) {
+                uint64_t count = c[b];
+                c[b] = offset;
+                offset += count;
+            }
+
+            for (uint64_t i = 0; i < n; i++) dst[c[digit(src[i], d)]++] = src[i];
+            std::swap(src, dst);
         }
 
-        uint64_t temp = timestamp;
-        timestamp -= lastTimestampOut;
-        lastTimestampOut = temp;
-        return encodeVarInt(timestamp + 1);
-    };
+        if (src != records) std::copy(src, src + n, records);
 
-    std::string encodeBound(const XorElem &bound, uint64_t &lastTimestampOut) {
-        std::string output;
+        auto less = [&](const SortRecord &a, const SortRecord &b){ return sortLess(a, b); };
 
-        output += encodeTimestampOut(bound.timestamp, lastTimestampOut);
-        output += encodeVarInt(bound.idSize);
-        output += bound.getId(idSize);
+        for (uint64_t i = 0; i < n; ) {
+            uint64_t j = i + 1;
+            while (j < n && records[j].timestamp == records[i].timestamp && records[j].idKey == records[i].idKey) j++;
+            if (j - i > 1) std::sort(records + i, records + j, less);
+            i = j;
+        }
+    }
 
-        return output;
-    };
+    void gatherItems(const std::vector<SortRecord> &records, bool dedup, unsigned numThreads) {
+        uint64_t n = records.size();
+        std::vector<uint64_t> sortedTimestamps(n);
+        std::string sortedIds(n * idSize, '\0');
 
-    XorElem getMinimalBound(const XorElem &prev, const XorElem &curr) {
-        if (curr.timestamp != prev.timestamp) {
-            return XorElem(curr.timestamp, "");
+        if (!dedup) {
+            parallelFor(numThreads, n, [&](uint64_t begin, uint64_t end){
+                for (auto i = begin; i < end; i++) {
+                    sortedTimestamps[i] = timestamps[records[i].index];
+                    memcpy(sortedIds.data() + i * idSize, ids.data() + records[i].index * idSize, idSize);
+                }
+            });
         } else {
-            uint64_t sharedPrefixBytes = 0;
-            auto currKey = curr.getId();
-            auto prevKey = prev.getId();
+            uint64_t out = 0;
+
+            for (uint64_t i = 0; i < n; i++) {
+                if (out && !sortLess(records[i - 1], records[i])) continue; // identical to previous item
 
-            for (uint64_t i = 0; i < idSize; i++) {
-                if (currKey[i] != prevKey[i]) break;
-                sharedPrefixBytes++;
+                sortedTimestamps[out] = timestamps[records[i].index];
+                memcpy(sortedIds.data() + out * idSize, ids.data() + records[i].index * idSize, idSize);
+                out++;
             }
 
-            return XorElem(curr.timestamp, currKey.substr(0, sharedPrefixBytes + 1));
+            sortedTimestamps.resize(out);
+            sortedIds.resize(out * idSize);
         }
+
+        timestamps = std::move(sortedTimestamps);
+        ids = std::move(sortedIds);
     }
 
-    std::string encodeBitField(const std::vector<uint64_t> inds) {
-        if (inds.size() == 0) return "";
-        uint64_t max = *std::max_element(inds.begin(), inds.end());
+    void buildFingerprintIndex() {
+        uint64_t numEntries = ColumnView::fingerprintIndexEntries(timestamps.size(), fingerprintIndexStride);
+        fingerprintIndex.assign(numEntries * idSize, '\0');
 
-        std::string bitField = std::string((max + 8) / 8, '\0');
-        for (auto ind : inds) bitField[ind / 8] |= 1 << ind % 8;
+        XorElem accum;
+        for (uint64_t i = 0; i < timestamps.size(); i++) {
+            if (i % fingerprintIndexStride == 0) memcpy(fingerprintIndex.data() + (i / fingerprintIndexStride) * idSize, accum.id, idSize);
+            accum.xorBytes(ids.data() + i * idSize, idSize);
+        }
 
-        return bitField;
+        if (timestamps.size() % fingerprintIndexStride == 0) memcpy(fingerprintIndex.data() + (numEntries - 1) * idSize, accum.id, idSize);
     }
+};
 
-    bool bitFieldLookup(const std::string &bitField, uint64_t ind) {
-        if ((ind + 8) / 8 > bitField.size()) return false;
-        return !!(bitField[ind / 8] & 1 << (ind % 8));
-    }
+
+// Memory-mapped, read-only sealed snapshot. The file layout (native byte order) is:
+//
+//   SnapshotHeader | timestamps (uint64_t * numItems) | ids (idSize * numItems) | padding to 8 bytes | fingerprint index
+//
+// Opening is O(1): pages are faulted in as reconciliation touches them, and processes mapping
+// the same file share the page cache. The checksum covers everything after the header.
+
+struct SnapshotHeader {
+    char magic[8];
+    uint64_t version;
+    uint64_t idSize;
+    uint64_t numItems;
+    uint64_t fingerprintIndexStride;
+    uint64_t checksum;
+    uint64_t reserved[2];
 };
 
+static_assert(sizeof(SnapshotHeader) == 64);
+
+inline const char *SNAPSHOT_MAGIC = "NEGSNAP";
+const uint64_t SNAPSHOT_VERSION = 1;
+
+struct SnapshotChecksum {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    char pending[8];
+    size_t numPending = 0;
+
+    void update(const char *p, size_t n) {
+        while (numPending && n) {
+            pending[numPending++] = *p++;
+            n--;
+            if (numPending == 8) {
+                mix(pending);
+                numPending = 0;
+            }
+        }
+
+        for (; n >= 8; p += 8, n -= 8) mix(p);
+
+        if (n) memcpy(pending, p, n);
+        numPending = n;
+    }
+
+    uint64_t final() {
+        for (size_t i = 0; i < numPending; i++) h = (h ^ static_cast<unsigned char>(pending[i])) * 0x100000001b3ULL;
+        numPending = 0;
+        return h;
+    }
+
+  private:
+    void mix(const char *p) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+};
+
+inline uint64_t snapshotIdsPadding(uint64_t numItems, uint64_t idSize) {
+    return (8 - (numItems * idSize) % 8) % 8;
+}
+
+inline void Vector::writeSnapshot(const std::string &path) const {
+    auto v = view();
+
+    SnapshotHeader header{};
+    memcpy(header.magic, SNAPSHOT_MAGIC, 8);
+    header.version = SNAPSHOT_VERSION;
+    header.idSize = idSize;
+    header.numItems = v.numItems;
+    header.fingerprintIndexStride = fingerprintIndexStride;
+
+    const char padding[8] = {};
+    std::string_view sections[] = {
+        std::string_view(reinterpret_cast<const char *>(timestamps.data()), timestamps.size() * sizeof(uint64_t)),
+        ids,
+        std::string_view(padding, snapshotIdsPadding(v.numItems, idSize)),
+        fingerprintIndex,
+    };
+
+    SnapshotChecksum checksum;
+    for (auto section : sections) checksum.update(section.data(), section.size());
+    header.checksum = checksum.final();
+
+    std::string tmpPath = path + ".tmp";
+    std::ofstream f(tmpPath, std::ios::binary | std::ios::trunc);
+    if (!f) throw negentropy::err("unable to open snapshot for writing");
+
+    f.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    for (auto section : sections) f.write(section.data(), section.size());
+
+    f.close();
+    if (!f) throw negentropy::err("error writing snapshot");
+
+    if (::rename(tmpPath.c_str(), path.c_str()) != 0) throw negentropy::err("unable to rename snapshot into place");
+}
+
+struct Snapshot : StorageBase {
+    // verifyChecksum reads the whole file to check it wasn't corrupted, and can be turned off when startup time
+    // matters more. buildSearchIndex reads every timestamp page up-front, trading startup time for faster lookups.
+    Snapshot(const std::string &path, bool verifyChecksum = true, bool buildSearchIndex = false) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd == -1) throw negentropy::err("unable to open snapshot");
+
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw negentropy::err("unable to stat snapshot");
+        }
+
+        mappingSize = st.st_size;
+        if (mappingSize < sizeof(SnapshotHeader)) {
+            ::close(fd);
+            throw negentropy::err("snapshot truncated");
+        }
+
+        void *m = ::mmap(nullptr, mappingSize, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (m == MAP_FAILED) throw negentropy::err("unable to mmap snapshot");
+        mapping = static_cast<const char *>(m);
+
+        try {
+            parse(verifyChecksum);
+
+            if (buildSearchIndex) {
+                searchIndex.build(columns.timestamps, columns.numItems);
+                columns.searchIndex = &searchIndex;
+            }
+        } catch (...) {
+            ::munmap(const_cast<char *>(mapping), mappingSize);
+            throw;
+        }
+    }
+
+    Snapshot(const Snapshot &) = delete;
+    Snapshot &operator=(const Snapshot &) = delete;
+
+    ~Snapshot() {
+        ::munmap(const_cast<char *>(mapping), mappingSize);
+    }
+
+    uint64_t idSize() const {
+        return columns.idSize;
+    }
+
+    const ColumnView &view() const {
+        return columns;
+    }
+
+    uint64_t size() const override {
+        return columns.numItems;
+    }
+
+    XorElem getItem(uint64_t i) const override {
+        return columns.getItem(i);
+    }
+
+    void iterate(uint64_t begin, uint64_t end, const std::function<void(const XorElem &, uint64_t)> &cb) const override {
+        columns.iterate(begin, end, cb);
+    }
+
+    uint64_t findUpperBound(uint64_t begin, uint64_t end, const XorElem &bound) const override {
+        return columns.findUpperBound(begin, end, bound);
+    }
+
+    XorElem fingerprint(uint64_t begin, uint64_t end) const override {
+        return columns.fingerprint(begin, end);
+    }
+
+    std::string_view packedIds(uint64_t begin, uint64_t end, uint64_t idSize_) const override {
+        return columns.packedIds(begin, end, idSize_);
+    }
+
+  private:
+    const char *mapping = nullptr;
+    size_t mappingSize = 0;
+    ColumnView columns;
+    SearchIndex searchIndex;
+
+    void parse(bool verifyChecksum) {
+        SnapshotHeader header;
+        memcpy(&header, mapping, sizeof(header));
+
+        if (memcmp(header.magic, SNAPSHOT_MAGIC, 8) != 0) throw negentropy::err("not a snapshot file");
+        if (header.version != SNAPSHOT_VERSION) throw negentropy::err("unsupported snapshot version");
+        if (header.idSize < 8 || header.idSize > 32) throw negentropy::err("snapshot idSize invalid");
+
+        uint64_t n = header.numItems;
+        uint64_t idsBytes = n * header.idSize;
+        uint64_t indexBytes = ColumnView::fingerprintIndexEntries(n, header.fingerprintIndexStride) * header.idSize;
+        uint64_t dataBytes = n * sizeof(uint64_t) + idsBytes + snapshotIdsPadding(n, header.idSize) + indexBytes;
+
+        if (n > mappingSize || mappingSize - sizeof(header) != dataBytes) throw negentropy::err("snapshot size mismatch");
+
+        const char *data = mapping + sizeof(header);
+
+        if (verifyChecksum) {
+            SnapshotChecksum checksum;
+            checksum.update(data, dataBytes);
+            if (checksum.final() != header.checksum) throw negentropy::err("snapshot checksum mismatch");
+        }
+
+        columns.idSize = header.idSize;
+        columns.numItems = n;
+        columns.timestamps = reinterpret_cast<const uint64_t *>(data);
+        columns.ids = data + n * sizeof(uint64_t);
+        columns.fingerprintIndex = header.fingerprintIndexStride ? columns.ids + idsBytes + snapshotIdsPadding(n, header.idSize) : nullptr;
+        columns.fingerprintIndexStride = header.fingerprintIndexStride;
+    }
+};
+
+
+// Block-compressed sealed store for very large sets, built by appending items in ascending order. Each block
+// of BlockSize items keeps its first timestamp, the XOR of all ids before it, and the offset of its remaining
+// timestamps, which are stored as LEB128 deltas. Ids are packed at idSize bytes (random bytes don't compress),
+// so fingerprints only touch ids, and lookups decode the timestamps of at most one block. With second-resolution
+// timestamps this is about 18 bytes per item at idSize 16, compared to 24 for Vector.
+
+struct Compressed : StorageBase {
+    static const uint64_t BlockSize = 64;
+
+    uint64_t idSize;
+
+    Compressed(uint64_t idSize) : idSize(idSize) {
+        if (idSize < 8 || idSize > 32) throw negentropy::err("idSize invalid");
+    }
+
+    // Copies any sorted storage, for example a sealed Vector or Snapshot
+    Compressed(uint64_t idSize, const StorageBase &sorted) : Compressed(idSize) {
+        reserve(sorted.size());
+        sorted.iterate(0, sorted.size(), [&](const XorElem &item, uint64_t){
+            append(item.timestamp, item.getId());
+        });
+        shrinkToFit();
+    }
+
+    void append(uint64_t createdAt, std::string_view id) {
+        if (id.size() < idSize || id.size() > 32) throw negentropy::err("bad id size for added item");
+        id = id.substr(0, idSize);
+
+        if (numItems % BlockSize == 0) {
+            if (numItems && !(lastItem < XorElem(createdAt, id))) throw negentropy::err("items must be appended in ascending order");
+
+            blockTimestamps.push_back(createdAt);
+            blockOffsets.push_back(deltas.size());
+            blockPrefixes.append(runningXor.getId(idSize));
+        } else {
+            if (!(lastItem < XorElem(createdAt, id))) throw negentropy::err("items must be appended in ascending order");
+
+            uint64_t delta = createdAt - lastItem.timestamp;
+            while (delta >= 0x80) {
+                deltas.push_back(static_cast<char>(delta | 0x80));
+                delta >>= 7;
+            }
+            deltas.push_back(static_cast<char>(delta));
+        }
+
+        ids.append(id);
+        runningXor.xorBytes(id.data(), idSize);
+        lastItem = XorElem(createdAt, id);
+        numItems++;
+    }
+
+    void reserve(uint64_t n) {
+        ids.reserve(n * idSize);
+        blockTimestamps.reserve((n + BlockSize - 1) / BlockSize);
+        blockOffsets.reserve((n + BlockSize - 1) / BlockSize);
+        blockPrefixes.reserve((n + BlockSize - 1) / BlockSize * idSize);
+    }
+
+    void shrinkToFit() {
+        ids.shrink_to_fit();
+        deltas.shrink_to_fit();
+        blockTimestamps.shrink_to_fit();
+        blockOffsets.shrink_to_fit();
+        blockPrefixes.shrink_to_fit();
+    }
+
+    // Bytes allocated, including unused capacity
+    uint64_t memoryUsage() const {
+        return ids.capacity() + deltas.capacity() + blockTimestamps.capacity() * sizeof(uint64_t) + blockOffsets.capacity() * sizeof(uint64_t) + blockPrefixes.capacity();
+    }
+
+    uint64_t size() const override {
+        return numItems;
+    }
+
+    // Append-only, so the size identifies the contents
+    uint64_t generation() const override {
+        return numItems;
+    }
+
+    XorElem getItem(uint64_t i) const override {
+        if (i >= numItems) throw negentropy::err("item index out of range");
+
+        const char *p;
+        return XorElem(decodeTimestamp(i, p), getId(i));
+    }
+
+    void iterate(uint64_t begin, uint64_t end, const std::function<void(const XorElem &, uint64_t)> &cb) const override {
+        uint64_t timestamp = 0;
+        const char *p = nullptr;
+
+        for (auto i = begin; i < end; i++) {
+            if (i == begin || i % BlockSize == 0) timestamp = decodeTimestamp(i, p);
+            else timestamp += decodeDelta(p);
+
+            cb(XorElem(timestamp, getId(i)), i);
+        }
+    }
+
+    std::string_view packedIds(uint64_t begin, uint64_t end, uint64_t idSize_) const override {
+        if (idSize_ != idSize || begin > end || end > numItems) return {};
+        return std::string_view(ids.data() + begin * idSize, (end - begin) * idSize);
+    }
+
+    uint64_t findUpperBound(uint64_t begin, uint64_t end, const XorElem &bound) const override {
+        if (begin >= end) return begin;
+
+        // Find the first block (after begin's) that starts after the bound: the answer is in the block before it
+
+        uint64_t lower = begin / BlockSize + 1, upper = (end - 1) / BlockSize + 1;
+        while (lower < upper) {
+            auto mid = lower + (upper - lower) / 2;
+            if (boundLess(bound, blockTimestamps[mid], mid * BlockSize)) upper = mid;
+            else lower = mid + 1;
+        }
+
+        uint64_t blockEnd = std::min(lower * BlockSize, end);
+        uint64_t i = std::max((lower - 1) * BlockSize, begin);
+        const char *p;
+        uint64_t timestamp = decodeTimestamp(i, p);
+
+        while (!boundLess(bound, timestamp, i)) {
+            if (++i == blockEnd) break;
+            timestamp += decodeDelta(p);
+        }
+
+        return i;
+    }
+
+    XorElem fingerprint(uint64_t begin, uint64_t end) const override {
+        XorElem output;
+
+        if (end - begin <= BlockSize) {
+            xorPackedIds(output, ids.data() + begin * idSize, end - begin, idSize);
+        } else {
+            xorPrefix(output, begin);
+            xorPrefix(output, end);
+        }
+
+        return output;
+    }
+
+  private:
+    std::string ids;
+    std::string deltas;
+    std::vector<uint64_t> blockTimestamps;
+    std::vector<uint64_t> blockOffsets; // into deltas
+    std::string blockPrefixes; // entry b (idSize bytes) is the XOR of items [0, b * BlockSize)
+    uint64_t numItems = 0;
+    XorElem lastItem;
+    XorElem runningXor;
+
+    std::string_view getId(uint64_t i) const {
+        return std::string_view(ids.data() + i * idSize, idSize);
+    }
+
+    // Timestamp of item i, leaving p at the delta of item i + 1 within the same block
+    uint64_t decodeTimestamp(uint64_t i, const char *&p) const {
+        uint64_t block = i / BlockSize;
+        uint64_t timestamp = blockTimestamps[block];
+        p = deltas.data() + blockOffsets[block];
+        for (uint64_t j = block * BlockSize; j < i; j++) timestamp += decodeDelta(p);
+        return timestamp;
+    }
+
+    static uint64_t decodeDelta(const char *&p) {
+        uint64_t delta = 0;
+        for (unsigned shift = 0; ; shift += 7) {
+            uint8_t byte = static_cast<uint8_t>(*p++);
+            delta |= uint64_t(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) return delta;
+        }
+    }
+
+    bool boundLess(const XorElem &bound, uint64_t timestamp, uint64_t i) const {
+        if (bound.timestamp != timestamp) return bound.timestamp < timestamp;
+        uint64_t key = loadIdKey(ids.data() + i * idSize);
+        if (bound.idKey != key) return bound.idKey < key;
+        return bound.getId() < getId(i);
+    }
+
+    void xorPrefix(XorElem &output, uint64_t n) const {
+        if (n == 0) return;
+        uint64_t block = (n - 1) / BlockSize;
+        output.xorBytes(blockPrefixes.data() + block * idSize, idSize);
+        xorPackedIds(output, ids.data() + block * BlockSize * idSize, n - block * BlockSize, idSize);
+    }
+};
+
+
+// Order-statistic B+tree: every node caches the number of items and the XOR of all items beneath it,
+// so insert, erase, index lookups and range fingerprints are all O(log n). It is always sorted and
+// can be modified while sessions are reconciling against it (but not concurrently from other threads).
+
+struct BTree : StorageBase {
+    static const size_t MaxNodeSize = 64;
+    static const size_t MinNodeSize = MaxNodeSize / 4;
+
+    struct Node {
+        uint64_t count = 0;
+        XorElem accum;
+        std::vector<XorElem> items; // leaf nodes only
+        std::vector<XorElem> keys; // inner nodes only: keys[i] <= every item in children[i] < keys[i + 1]
+        std::vector<std::unique_ptr<Node>> children; // inner nodes only
+
+        bool isLeaf() const {
+            return children.empty();
+        }
+
+        size_t width() const {
+            return isLeaf() ? items.size() : children.size();
+        }
+
+        const XorElem &firstKey() const {
+            return isLeaf() ? items.front() : keys.front();
+        }
+
+        size_t route(const XorElem &key) const {
+            return std::upper_bound(keys.begin() + 1, keys.end(), key) - keys.begin() - 1;
+        }
+
+        void recompute() {
+            count = 0;
+            accum = XorElem();
+
+            if (isLeaf()) {
+                count = items.size();
+                for (const auto &item : items) accum ^= item;
+            } else {
+                for (const auto &c : children) {
+                    count += c->count;
+                    accum ^= c->accum;
+                }
+            }
+        }
+    };
+
+    std::unique_ptr<Node> root = std::make_unique<Node>();
+    uint64_t modifications = 0;
+
+    bool insert(uint64_t createdAt, std::string_view id) {
+        XorElem item(createdAt, id);
+        std::unique_ptr<Node> split;
+
+        if (!insertAux(*root, item, split)) return false;
+        modifications++;
+
+        if (split) {
+            auto newRoot = std::make_unique<Node>();
+            newRoot->keys.push_back(XorElem(0, ""));
+            newRoot->keys.push_back(split->firstKey());
+            newRoot->children.push_back(std::move(root));
+            newRoot->children.push_back(std::move(split));
+            newRoot->recompute();
+            root = std::move(newRoot);
+        }
+
+        return true;
+    }
+
+    bool erase(uint64_t createdAt, std::string_view id) {
+        XorElem item(createdAt, id);
+
+        if (!eraseAux(*root, item)) return false;
+        modifications++;
+
+        if (!root->isLeaf() && root->children.size() == 1) {
+            auto child = std::move(root->children[0]);
+            root = std::move(child);
+        }
+
+        return true;
+    }
+
+    uint64_t size() const override {
+        return root->count;
+    }
+
+    uint64_t generation() const override {
+        return modifications;
+    }
+
+    XorElem getItem(uint64_t i) const override {
+        if (i >= root->count) throw negentropy::err("item index out of range");
+        const Node *node = root.get();
+
+        while (!node->isLeaf()) {
+            for (const auto &c : node->children) {
+                if (i < c->count) {
+                    node = c.get();
+                    break;
+                }
+                i -= c->count;
+            }
+        }
+
+        return node->items[i];
+    }
+
+    void iterate(uint64_t begin, uint64_t end, const std::function<void(const XorElem &, uint64_t)> &cb) const override {
+        iterateAux(*root, 0, begin, end, cb);
+    }
+
+    uint64_t findUpperBound(uint64_t begin, uint64_t end, const XorElem &bound) const override {
+        uint64_t rank = 0;
+        const Node *node = root.get();
+
+        while (!node->isLeaf()) {
+            size_t i = node->route(bound);
+            for (size_t j = 0; j < i; j++) rank += node->children[j]->count;
+            node = node->children[i].get();
+        }
+
+        rank += std::upper_bound(node->items.begin(), node->items.end(), bound) - node->items.begin();
+
+        return std::clamp(rank, begin, end);
+    }
+
+    XorElem fingerprint(uint64_t begin, uint64_t end) const override {
+        XorElem output;
+        xorPrefix(output, begin);
+        xorPrefix(output, end);
+        return output;
+    }
+
+  private:
+    bool insertAux(Node &node, const XorElem &item, std::unique_ptr<Node> &split) {
+        if (node.isLeaf()) {
+            auto it = std::upper_bound(node.items.begin(), node.items.end(), item);
+            if (it != node.items.begin() && *std::prev(it) == item) return false;
+            node.items.insert(it, item);
+        } else {
+            size_t i = node.route(item);
+            std::unique_ptr<Node> childSplit;
+
+            if (!insertAux(*node.children[i], item, childSplit)) return false;
+
+            if (childSplit) {
+                node.keys.insert(node.keys.begin() + i + 1, childSplit->firstKey());
+                node.children.insert(node.children.begin() + i + 1, std::move(childSplit));
+            }
+        }
+
+        node.count++;
+        node.accum ^= item;
+
+        if (node.width() > MaxNodeSize) {
+            split = std::make_unique<Node>();
+            size_t half = node.width() / 2;
+
+            if (node.isLeaf()) {
+                split->items.assign(node.items.begin() + half, node.items.end());
+                node.items.resize(half);
+            } else {
+                split->keys.assign(node.keys.begin() + half, node.keys.end());
+                node.keys.resize(half);
+                for (size_t i = half; i < node.children.size(); i++) split->children.push_back(std::move(node.children[i]));
+                node.children.resize(half);
+            }
+
+            node.recompute();
+            split->recompute();
+        }
+
+        return true;
+    }
+
+    bool eraseAux(Node &node, const XorElem &item) {
+        if (node.isLeaf()) {
+            auto it = std::lower_bound(node.items.begin(), node.items.end(), item);
+            if (it == node.items.end() || !(*it == item)) return false;
+            node.items.erase(it);
+        } else {
+            size_t i = node.route(item);
+
+            if (!eraseAux(*node.children[i], item)) return false;
+            if (node.children[i]->width() < MinNodeSize) rebalance(node, i);
+        }
+
+        node.count--;
+        node.accum ^= item;
+
+        return true;
+    }
+
+    void rebalance(Node &parent, size_t i) {
+        if (parent.children.size() == 1) return;
+
+        if (i > 0 && parent.children[i - 1]->width() > MinNodeSize) {
+            auto &left = *parent.children[i - 1];
+            auto &child = *parent.children[i];
+
+            if (child.isLeaf()) {
+                child.items.insert(child.items.begin(), left.items.back());
+                left.items.pop_back();
+                parent.keys[i] = child.items.front();
+            } else {
+                child.keys[0] = parent.keys[i];
+                child.keys.insert(child.keys.begin(), left.keys.back());
+                child.children.insert(child.children.begin(), std::move(left.children.back()));
+                parent.keys[i] = left.keys.back();
+                left.keys.pop_back();
+                left.children.pop_back();
+            }
+
+            left.recompute();
+            child.recompute();
+        } else if (i + 1 < parent.children.size() && parent.children[i + 1]->width() > MinNodeSize) {
+            auto &child = *parent.children[i];
+            auto &right = *parent.children[i + 1];
+
+            if (child.isLeaf()) {
+                child.items.push_back(right.items.front());
+                right.items.erase(right.items.begin());
+                parent.keys[i + 1] = right.items.front();
+            } else {
+                child.keys.push_back(parent.keys[i + 1]);
+                child.children.push_back(std::move(right.children.front()));
+                parent.keys[i + 1] = right.keys[1];
+                right.keys.erase(right.keys.begin());
+                right.children.erase(right.children.begin());
+            }
+
+            child.recompute();
+            right.recompute();
+        } else {
+            if (i == 0) i = 1; // merge children[i] into children[i - 1]
+
+            auto &left = *parent.children[i - 1];
+            auto &right = *parent.children[i];
+
+            if (left.isLeaf()) {
+                left.items.insert(left.items.end(), right.items.begin(), right.items.end());
+            } else {
+                left.keys.push_back(parent.keys[i]);
+                left.keys.insert(left.keys.end(), right.keys.begin() + 1, right.keys.end());
+                for (auto &c : right.children) left.children.push_back(std::move(c));
+            }
+
+            left.recompute();
+            parent.keys.erase(parent.keys.begin() + i);
+            parent.children.erase(parent.children.begin() + i);
+        }
+    }
+
+    void iterateAux(const Node &node, uint64_t offset, uint64_t begin, uint64_t end, const std::function<void(const XorElem &, uint64_t)> &cb) const {
+        if (node.isLeaf()) {
+            for (uint64_t i = std::max(begin, offset); i < std::min(end, offset + node.count); i++) cb(node.items[i - offset], i);
+            return;
+        }
+
+        for (const auto &c : node.children) {
+            if (offset >= end) break;
+            if (offset + c->count > begin) iterateAux(*c, offset, begin, end, cb);
+            offset += c->count;
+        }
+    }
+
+    void xorPrefix(XorElem &output, uint64_t n) const {
+        const Node *node = root.get();
+
+        while (!node->isLeaf()) {
+            const Node *next = nullptr;
+
+            for (const auto &c : node->children) {
+                if (n < c->count) {
+                    next = c.get();
+                    break;
+                }
+                n -= c->count;
+                output ^= c->accum;
+            }
+
+            if (!next) return;
+            node = next;
+        }
+
+        for (uint64_t i = 0; i < n; i++) output ^= node->items[i];
+    }
+};
+
+
+
+// LSM-style layered store for sets that keep growing while sessions reconcile against them.
+//
+// New items go into a small sorted delta. When the delta fills up it is sealed into an immutable
+// level, and levels of similar size are merged (in a background thread, by default) so there are
+// only O(log n) of them. pin() returns a consistent, immutable multi-level Version for sessions:
+// writers never block on sessions, and a session never sees a partially applied merge.
+//
+// Items can only be inserted: there is no erase. Use BTree if items need to be removed.
+
+struct LayeredOptions {
+    uint64_t deltaLimit = 4096; // items buffered before the delta becomes a level
+    uint64_t fingerprintIndexStride = 64; // used for every sealed level
+    bool backgroundMerge = true; // merge levels in a background thread instead of inside insert()
+};
+
+struct Layered {
+    // A pinned, read-only view of all levels. Item indices refer to the merged order, which is mapped
+    // to per-level positions by selection. Recently used mappings are cached per thread, so fingerprints
+    // and iterations over a range found by findUpperBound() don't repeat the search.
+
+    struct Version : StorageBase {
+        // Per-level positions, stored inline for the usual number of levels so that locating doesn't allocate
+
+        struct Positions {
+            static const size_t InlineLevels = 32;
+
+            Positions(size_t n = 0, uint64_t value = 0) : n(n) {
+                if (n > InlineLevels) large.resize(n);
+                std::fill_n(data(), n, value);
+            }
+
+            uint64_t &operator[](size_t i) { return data()[i]; }
+            uint64_t operator[](size_t i) const { return data()[i]; }
+
+          private:
+            size_t n;
+            std::array<uint64_t, InlineLevels> small{};
+            std::vector<uint64_t> large;
+
+            uint64_t *data() { return n > InlineLevels ? large.data() : small.data(); }
+            const uint64_t *data() const { return n > InlineLevels ? large.data() : small.data(); }
+        };
+
+        std::vector<std::shared_ptr<const Vector>> levels;
+
+        Version(std::vector<std::shared_ptr<const Vector>> levels_) : levels(std::move(levels_)) {
+            static std::atomic<uint64_t> nextVersionId = 1;
+            versionId = nextVersionId++;
+
+            for (const auto &l : levels) {
+                views.push_back(l->view());
+                total += views.back().numItems;
+            }
+        }
+
+        uint64_t size() const override {
+            return total;
+        }
+
+        XorElem getItem(uint64_t i) const override {
+            if (i >= total) throw negentropy::err("item index out of range");
+            auto pos = locate(i);
+            std::optional<uint64_t> best;
+
+            for (size_t l = 0; l < views.size(); l++) {
+                if (pos[l] < views[l].numItems && (!best || itemLess(l, pos[l], *best, pos[*best]))) best = l;
+            }
+
+            return views[*best].getItem(pos[*best]);
+        }
+
+        void iterate(uint64_t begin, uint64_t end, const std::function<void(const XorElem &, uint64_t)> &cb) const override {
+            if (begin >= end) return;
+            auto pos = locate(begin);
+
+            for (auto i = begin; i < end; i++) {
+                size_t best = views.size();
+
+                for (size_t l = 0; l < views.size(); l++) {
+                    if (pos[l] < views[l].numItems && (best == views.size() || itemLess(l, pos[l], best, pos[best]))) best = l;
+                }
+
+                cb(views[best].getItem(pos[best]), i);
+                pos[best]++;
+            }
+
+            remember(end, pos);
+        }
+
+        uint64_t findUpperBound(uint64_t begin, uint64_t end, const XorElem &bound) const override {
+            Positions pos(views.size());
+            uint64_t rank = 0;
+
+            for (size_t l = 0; l < views.size(); l++) {
+                pos[l] = views[l].findUpperBound(0, views[l].numItems, bound);
+                rank += pos[l];
+            }
+
+            remember(rank, pos);
+
+            return std::clamp(rank, begin, end);
+        }
+
+        XorElem fingerprint(uint64_t begin, uint64_t end) const override {
+            auto lower = locate(begin);
+            auto upper = locate(end);
+            XorElem output;
+
+            for (size_t l = 0; l < views.size(); l++) output ^= views[l].fingerprint(lower[l], upper[l]);
+
+            return output;
+        }
+
+      private:
+        std::vector<ColumnView> views;
+        uint64_t total = 0;
+        uint64_t versionId;
+
+        struct CachedPosition {
+            uint64_t versionId = 0;
+            uint64_t rank;
+            Positions pos;
+        };
+
+        static const size_t PositionCacheSize = 8;
+
+        static std::array<CachedPosition, PositionCacheSize> &positionCache() {
+            static thread_local std::array<CachedPosition, PositionCacheSize> cache;
+            return cache;
+        }
+
+        void remember(uint64_t rank, const Positions &pos) const {
+            static thread_local size_t next = 0;
+            auto &entry = positionCache()[next++ % PositionCacheSize];
+            entry.versionId = versionId;
+            entry.rank = rank;
+            entry.pos = pos;
+        }
+
+        bool itemLess(size_t la, uint64_t ia, size_t lb, uint64_t ib) const {
+            uint64_t ta = views[la].timestamps[ia], tb = views[lb].timestamps[ib];
+            if (ta != tb) return ta < tb;
+            return memcmp(views[la].ids + ia * views[la].idSize, views[lb].ids + ib * views[lb].idSize, views[la].idSize) < 0;
+        }
+
+        // Per-level positions of the first k items in merged order
+
+        Positions locate(uint64_t k) const {
+            for (const auto &entry : positionCache()) {
+                if (entry.versionId == versionId && entry.rank == k) return entry.pos;
+            }
+
+            size_t numLevels = views.size();
+            Positions lo(numLevels), hi(numLevels), counts(numLevels);
+            for (size_t l = 0; l < numLevels; l++) hi[l] = views[l].numItems;
+
+            // Invariant: in level l, items before lo[l] are among the first k and items from hi[l] on are not
+
+            while (true) {
+                size_t m = 0;
+                for (size_t l = 1; l < numLevels; l++) {
+                    if (hi[l] - lo[l] > hi[m] - lo[m]) m = l;
+                }
+                if (numLevels == 0 || hi[m] == lo[m]) break;
+
+                uint64_t mid = lo[m] + (hi[m] - lo[m]) / 2;
+                auto pivot = views[m].getItem(mid);
+                uint64_t rank = 0;
+
+                for (size_t l = 0; l < numLevels; l++) {
+                    counts[l] = l == m ? mid : lowerBound(l, pivot);
+                    rank += counts[l];
+                }
+
+                if (rank == k) {
+                    lo = counts;
+                    break;
+                } else if (rank < k) {
+                    for (size_t l = 0; l < numLevels; l++) lo[l] = std::max(lo[l], counts[l]);
+                    lo[m] = mid + 1;
+                } else {
+                    for (size_t l = 0; l < numLevels; l++) hi[l] = std::min(hi[l], counts[l]);
+                }
+            }
+
+            remember(k, lo);
+            return lo;
+        }
+
+        uint64_t lowerBound(size_t l, const XorElem &item) const {
+            const auto &v = views[l];
+            uint64_t lower = 0, upper = v.numItems;
+
+            while (lower < upper) {
+                uint64_t mid = lower + (upper - lower) / 2;
+                if (v.timestamps[mid] != item.timestamp ? v.timestamps[mid] < item.timestamp : memcmp(v.ids + mid * v.idSize, item.id, v.idSize) < 0) lower = mid + 1;
+                else upper = mid;
+            }
+
+            return lower;
+        }
+    };
+
+    Layered(uint64_t idSize, const LayeredOptions &opts = LayeredOptions()) : idSize(idSize), opts(opts) {
+        if (idSize < 8 || idSize > 32) throw negentropy::err("idSize invalid");
+        if (opts.deltaLimit == 0) throw negentropy::err("deltaLimit must be non-zero");
+        if (opts.backgroundMerge) mergeThread = std::thread([this]{ mergeLoop(); });
+    }
+
+    Layered(const Layered &) = delete;
+    Layered &operator=(const Layered &) = delete;
+
+    ~Layered() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            shuttingDown = true;
+        }
+
+        mergeCv.notify_all();
+        if (mergeThread.joinable()) mergeThread.join();
+    }
+
+    // Returns false if the item is already present
+    bool insert(uint64_t createdAt, std::string_view id) {
+        if (id.size() < idSize) throw negentropy::err("id too small");
+        XorElem item(createdAt, id.substr(0, idSize));
+
+        std::unique_lock<std::mutex> lock(mutex);
+
+        auto it = std::lower_bound(delta.begin(), delta.end(), item);
+        if (it != delta.end() && *it == item) return false;
+
+        for (const auto &level : levels) {
+            auto v = level->view();
+            auto upper = v.findUpperBound(0, v.numItems, item);
+            if (upper > 0 && v.timestamps[upper - 1] == item.timestamp && v.getId(upper - 1) == item.getId()) return false;
+        }
+
+        delta.insert(it, item);
+        currVersion.reset();
+
+        if (delta.size() >= opts.deltaLimit) {
+            levels.push_back(freezeDelta());
+            delta.clear();
+
+            if (opts.backgroundMerge) mergeCv.notify_one();
+            else while (mergeStep(lock)) {}
+        }
+
+        return true;
+    }
+
+    // A consistent snapshot of all items inserted so far, for sessions to reconcile against
+    std::shared_ptr<const StorageBase> pin() {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (!currVersion) {
+            auto versionLevels = levels;
+            if (delta.size()) versionLevels.push_back(freezeDelta());
+            currVersion = std::make_shared<Version>(std::move(versionLevels));
+        }
+
+        return currVersion;
+    }
+
+    size_t numLevels() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return levels.size();
+    }
+
+  private:
+    uint64_t idSize;
+    LayeredOptions opts;
+
+    std::mutex mutex;
+    std::vector<XorElem> delta; // sorted
+    std::vector<std::shared_ptr<const Vector>> levels; // oldest (and largest) first
+    std::shared_ptr<const Version> currVersion;
+
+    std::thread mergeThread;
+    std::condition_variable mergeCv;
+    bool merging = false;
+    bool shuttingDown = false;
+
+    std::shared_ptr<const Vector> freezeDelta() {
+        auto level = std::make_shared<Vector>(idSize);
+        for (const auto &item : delta) level->addItem(item.timestamp, item.getId());
+        level->seal(SealOptions{ opts.fingerprintIndexStride, false, 1 });
+        return level;
+    }
+
+    std::shared_ptr<const Vector> mergeLevels(const Vector &a, const Vector &b) {
+        auto va = a.view(), vb = b.view();
+        auto merged = std::make_shared<Vector>(idSize);
+        merged->timestamps.reserve(va.numItems + vb.numItems);
+        merged->ids.reserve((va.numItems + vb.numItems) * idSize);
+
+        uint64_t i = 0, j = 0;
+
+        while (i < va.numItems || j < vb.numItems) {
+            bool takeA = j == vb.numItems || (i < va.numItems && (va.timestamps[i] != vb.timestamps[j] ? va.timestamps[i] < vb.timestamps[j] : va.getId(i) < vb.getId(j)));
+            const auto &v = takeA ? va : vb;
+            uint64_t &k = takeA ? i : j;
+
+            merged->timestamps.push_back(v.timestamps[k]);
+            merged->ids.append(v.getId(k));
+            k++;
+        }
+
+        merged->seal(SealOptions{ opts.fingerprintIndexStride, false, 1 });
+        return merged;
+    }
+
+    // Merges the smallest adjacent pair of levels in which the older is at most twice the size of the newer, so
+    // levels that pile up while a merge runs are merged among themselves before going into the large old ones.
+    // Called with the lock held, which is released during the merge itself: only this function removes levels, and
+    // insert() only appends them, so the two merged levels are still adjacent afterwards.
+
+    bool mergeStep(std::unique_lock<std::mutex> &lock) {
+        if (merging) return false;
+
+        std::optional<size_t> best;
+
+        for (size_t i = 0; i + 1 < levels.size(); i++) {
+            uint64_t older = levels[i]->size(), newer = levels[i + 1]->size();
+            if (older > 2 * newer) continue;
+            if (!best || older + newer < levels[*best]->size() + levels[*best + 1]->size()) best = i;
+        }
+
+        if (!best) return false;
+
+        auto a = levels[*best], b = levels[*best + 1];
+
+        merging = true;
+        lock.unlock();
+        auto merged = mergeLevels(*a, *b);
+        lock.lock();
+        merging = false;
+
+        auto it = std::find(levels.begin(), levels.end(), a);
+        *it = merged;
+        levels.erase(it + 1);
+        currVersion.reset();
+
+        return true;
+    }
+
+    void mergeLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (!shuttingDown) {
+            if (!mergeStep(lock)) mergeCv.wait(lock);
+        }
+    }
+};
+
+}
+
+
+// Wire encoding helpers. Writer appends fields straight into one output buffer, and Reader is a cursor over
+// an incoming message whose returned views point into the message, so neither allocates per field.
+
+template <typename Buf>
+struct Writer {
+    Buf &buf;
+
+    void varInt(uint64_t n) {
+        char tmp[10];
+        size_t i = sizeof(tmp);
+
+        tmp[--i] = static_cast<char>(n & 0x7F);
+        while (n >>= 7) tmp[--i] = static_cast<char>(0x80 | (n & 0x7F));
+
+        buf.append(tmp + i, sizeof(tmp) - i);
+    }
+
+    void bytes(std::string_view s) {
+        buf.append(s);
+    }
+};
+
+template <typename Buf>
+Writer(Buf &) -> Writer<Buf>;
+
+struct Reader {
+    const char *p;
+    const char *end;
+
+    Reader(std::string_view s) : p(s.data()), end(s.data() + s.size()) {
+    }
+
+    bool empty() const {
+        return p == end;
+    }
+
+    uint64_t varInt() {
+        if (p != end && !(*p & 0x80)) return static_cast<uint8_t>(*p++);
+        if (end - p >= 8) {
+            uint64_t v;
+            if (varInt8(v)) return v;
+        }
+
+        uint64_t res = 0;
+
+        while (1) {
+            if (p == end) throw negentropy::err("premature end of varint");
+            uint64_t byte = static_cast<uint8_t>(*p++);
+            res = (res << 7) | (byte & 0b0111'1111);
+            if ((byte & 0b1000'0000) == 0) break;
+        }
+
+        return res;
+    }
+
+    std::string_view bytes(uint64_t n) {
+        if (static_cast<uint64_t>(end - p) < n) throw negentropy::err("parse ends prematurely");
+        std::string_view res(p, n);
+        p += n;
+        return res;
+    }
+
+    // n items of size bytes each, checking for overflow
+    std::string_view bytes(uint64_t n, uint64_t size) {
+        if (n > static_cast<uint64_t>(end - p) / size) throw negentropy::err("parse ends prematurely");
+        return bytes(n * size);
+    }
+
+  private:
+    // SWAR decode of a varint of up to 8 bytes, with at least 8 bytes readable: find the terminating byte
+    // from the continuation bits, then squeeze out the continuation bits in three shift-and-mask steps
+    bool varInt8(uint64_t &res) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        w = __builtin_bswap64(w);
+#endif
+
+        uint64_t terminators = ~w & 0x8080808080808080ULL;
+        if (!terminators) return false;
+        uint64_t len = __builtin_ctzll(terminators) / 8 + 1;
+
+        // The first byte is the most significant group: reverse them so the last byte is lowest
+        w = __builtin_bswap64(w) >> (64 - 8 * len);
+        w &= 0x7F7F7F7F7F7F7F7FULL;
+        w = (w & 0x007F007F007F007FULL) | ((w & 0x7F007F007F007F00ULL) >> 1);
+        w = (w & 0x00003FFF00003FFFULL) | ((w & 0x3FFF00003FFF0000ULL) >> 2);
+        w = (w & 0x000000000FFFFFFFULL) | ((w & 0x0FFFFFFF00000000ULL) >> 4);
+
+        res = w;
+        p += len;
+        return true;
+    }
+};
+
+
+// A message as a list of slices in order, for writev()/sendmsg() (in batches of at most IOV_MAX). Encoded
+// fields are copied into buffer, but larger runs of ids are referenced where the storage keeps them packed
+// (see StorageBase::packedIds()). The slices are valid until the next call that writes to this object, or until
+// the storage is modified.
+
+struct OutputSlices {
+    static const uint64_t MinReferenceSize = 128; // smaller runs are cheaper to copy than to add a slice for
+
+    std::string buffer;
+    std::vector<iovec> slices;
+
+    uint64_t size() const {
+        return totalSize;
+    }
+
+    // The message as a single string
+    std::string str() const {
+        std::string output;
+        output.reserve(totalSize);
+        for (const auto &s : slices) output.append(static_cast<const char *>(s.iov_base), s.iov_len);
+        return output;
+    }
+
+    void clear() {
+        buffer.clear();
+        slices.clear();
+        pieces.clear();
+        totalSize = 0;
+    }
+
+    void reserve(uint64_t n) {
+        buffer.reserve(n);
+    }
+
+    void append(const char *p, size_t n) {
+        if (pieces.empty() || pieces.back().ptr) pieces.push_back({ nullptr, buffer.size(), 0 });
+        buffer.append(p, n);
+        pieces.back().size += n;
+        totalSize += n;
+    }
+
+    void append(std::string_view s) {
+        append(s.data(), s.size());
+    }
+
+    void reference(std::string_view s) {
+        if (s.size() < MinReferenceSize) {
+            append(s);
+            return;
+        }
+
+        pieces.push_back({ s.data(), 0, s.size() });
+        totalSize += s.size();
+    }
+
+    // Drops everything after the first n bytes
+    void resize(uint64_t n) {
+        while (totalSize > n) {
+            auto &last = pieces.back();
+            uint64_t drop = std::min(last.size, totalSize - n);
+
+            if (!last.ptr) buffer.resize(buffer.size() - drop);
+            last.size -= drop;
+            totalSize -= drop;
+
+            if (last.size == 0) pieces.pop_back();
+        }
+    }
+
+    // Resolves the slices once the buffer won't move again
+    void finish() {
+        slices.clear();
+        for (const auto &p : pieces) slices.push_back({ const_cast<char *>(p.ptr ? p.ptr : buffer.data() + p.offset), p.size });
+    }
+
+  private:
+    struct Piece {
+        const char *ptr; // nullptr = at offset in buffer
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    std::vector<Piece> pieces;
+    uint64_t totalSize = 0;
+};
+
+
+// Monotonic arena for scratch data that only lives for one message. Resetting it keeps a single block
+// from the upstream resource, which grows to cover whatever the largest message so far overflowed into, so
+// steady-state rounds don't touch the upstream allocator at all.
+
+struct RoundArena {
+    RoundArena(std::pmr::memory_resource *upstream) : counter(upstream) {
+    }
+
+    ~RoundArena() {
+        arena.reset();
+        if (block) counter.upstream->deallocate(block, blockSize);
+    }
+
+    RoundArena(const RoundArena &) = delete;
+    RoundArena &operator=(const RoundArena &) = delete;
+
+    std::pmr::memory_resource *begin() {
+        if (!arena) {
+            if (!block) block = counter.upstream->allocate(blockSize);
+            arena.emplace(block, blockSize, &counter);
+        }
+
+        return &*arena;
+    }
+
+    // Everything allocated since begin() must already be destroyed
+    void end() {
+        arena->release();
+        if (counter.overflow == 0) return;
+
+        arena.reset();
+        counter.upstream->deallocate(block, blockSize);
+        block = nullptr;
+
+        size_t needed = blockSize + counter.overflow;
+        while (blockSize < needed) blockSize *= 2;
+        counter.overflow = 0;
+    }
+
+    struct Scope {
+        RoundArena &arena;
+        std::pmr::memory_resource *resource;
+
+        Scope(RoundArena &arena) : arena(arena), resource(arena.begin()) {
+        }
+
+        ~Scope() {
+            arena.end();
+        }
+    };
+
+  private:
+    struct CountingResource : std::pmr::memory_resource {
+        std::pmr::memory_resource *upstream;
+        uint64_t overflow = 0;
+
+        CountingResource(std::pmr::memory_resource *upstream) : upstream(upstream) {
+        }
+
+        void *do_allocate(size_t bytes, size_t alignment) override {
+            overflow += bytes;
+            return upstream->allocate(bytes, alignment);
+        }
+
+        void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+            upstream->deallocate(p, bytes, alignment);
+        }
+
+        bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+            return this == &other;
+        }
+    };
+
+    CountingResource counter;
+    std::optional<std::pmr::monotonic_buffer_resource> arena;
+    void *block = nullptr;
+    size_t blockSize = 16384;
+};
+
+
+// idSize as a compile-time constant when IdSize is non-zero, so that id copies, compares and hashes
+// are fixed-size, or as a runtime value when IdSize is 0
+
+template <uint64_t IdSize>
+struct IdSizeField {
+    static constexpr uint64_t idSize = IdSize;
+
+    IdSizeField(uint64_t idSize_) {
+        if (idSize_ != IdSize) throw negentropy::err("idSize mismatch");
+    }
+};
+
+template <>
+struct IdSizeField<0> {
+    uint64_t idSize;
+
+    IdSizeField(uint64_t idSize_) : idSize(idSize_) {
+    }
+};
+
+
+// Open-addressing hash table over the packed ids of an incoming IdList, which stay in the message buffer.
+// Hashes cover every id byte with a per-process seed, so a peer can't cheaply send colliding ids. It is
+// reused between the ranges of a message, so it only allocates when it grows.
+
+template <uint64_t IdSize>
+struct IdListTable : IdSizeField<IdSize> {
+    using IdSizeField<IdSize>::idSize;
+
+    std::pmr::vector<uint32_t> slots; // 1 + index into the list, 0 = empty
+    std::pmr::vector<uint8_t> found; // per list entry: matched by one of our items (or a duplicate of an earlier entry)
+
+    IdListTable(uint64_t idSize_, std::pmr::memory_resource *resource = std::pmr::get_default_resource()) : IdSizeField<IdSize>(idSize_), slots(resource), found(resource) {
+    }
+
+    void build(std::string_view packedIds) {
+        ids = packedIds.data();
+        uint64_t n = packedIds.size() / idSize;
+        if (n >= std::numeric_limits<uint32_t>::max()) throw negentropy::err("IdList too large");
+
+        uint64_t numSlots = 16;
+        while (numSlots < n * 2) numSlots *= 2;
+        mask = numSlots - 1;
+
+        slots.assign(numSlots, 0);
+        found.assign(n, 0);
+
+        for (uint64_t i = 0; i < n; i++) {
+            const char *id = ids + i * idSize;
+
+            for (uint64_t s = hash(id) & mask; ; s = (s + 1) & mask) {
+                if (slots[s] == 0) {
+                    slots[s] = i + 1;
+                    break;
+                }
+
+                if (memcmp(ids + (slots[s] - 1) * idSize, id, idSize) == 0) {
+                    found[i] = 1; // duplicate: only the first entry counts
+                    break;
+                }
+            }
+        }
+    }
+
+    // If id (idSize bytes) is in the list, marks it found and returns true
+    bool mark(const char *id) {
+        for (uint64_t s = hash(id) & mask; slots[s]; s = (s + 1) & mask) {
+            uint64_t i = slots[s] - 1;
+            if (memcmp(ids + i * idSize, id, idSize) == 0) {
+                found[i] = 1;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+  private:
+    const char *ids = nullptr;
+    uint64_t mask = 0;
+
+    uint64_t hash(const char *id) const {
+        static const uint64_t seed = std::random_device{}() | uint64_t(std::random_device{}()) << 32;
+
+        uint64_t h = seed, w;
+        for (uint64_t off = 0; off + 8 < idSize; off += 8) {
+            memcpy(&w, id + off, 8);
+            h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+            h ^= h >> 32;
+        }
+
+        memcpy(&w, id + idSize - 8, 8);
+        h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+        return h ^ (h >> 29);
+    }
+};
+
+
+// Invertible Bloom Lookup Table of ids, for the IBLT mode. Each id is added to one cell in each of 3 subtables, which
+// hold the number of ids added and the XORs of the ids and of their checksums. Subtracting the peer's table from
+// ours leaves only the ids in one set and not the other, and if there are few enough of them, cells left holding a
+// single id can be peeled off until the table is empty. Both peers must hash ids alike, so unlike IdListTable's the
+// hashes are unseeded, and read ids as little-endian words.
+
+template <uint64_t IdSize>
+struct Iblt : IdSizeField<IdSize> {
+    using IdSizeField<IdSize>::idSize;
+
+    static constexpr uint64_t MaxCells = 3 << 14;
+
+    uint64_t numCells = 0;
+    std::pmr::vector<int64_t> counts;
+    std::pmr::string keySums;
+    std::pmr::vector<uint64_t> checkSums;
+
+    Iblt(uint64_t idSize_, std::pmr::memory_resource *resource = std::pmr::get_default_resource()) : IdSizeField<IdSize>(idSize_), counts(resource), keySums(resource), checkSums(resource), pure(resource) {
+    }
+
+    static uint64_t encodedSize(uint64_t idSize, uint64_t numCells) {
+        return numCells * (idSize + 9) + 3;
+    }
+
+    void reset(uint64_t numCells_) {
+        if (numCells_ < 3 || numCells_ > MaxCells || numCells_ % 3) throw negentropy::err("invalid IBLT size");
+        numCells = numCells_;
+        counts.assign(numCells, 0);
+        keySums.assign(numCells * idSize, '\0');
+        checkSums.assign(numCells, 0);
+    }
+
+    void add(const char *id, int64_t delta) {
+        uint64_t h = hash(id);
+        uint64_t check = checkHash(h);
+
+        for (uint64_t j = 0; j < 3; j++) {
+            uint64_t c = cellOf(h, j);
+            counts[c] += delta;
+            checkSums[c] ^= check;
+            xorId(keySums.data() + c * idSize, id);
+        }
+    }
+
+    template <typename Buf>
+    void encode(Writer<Buf> &w) const {
+        w.varInt(numCells);
+
+        for (uint64_t i = 0; i < numCells; i++) {
+            w.varInt(counts[i] < 0 ? (uint64_t(-(counts[i] + 1)) << 1) | 1 : uint64_t(counts[i]) << 1);
+            w.bytes(std::string_view(keySums.data() + i * idSize, idSize));
+
+            char check[8];
+            for (uint64_t b = 0; b < 8; b++) check[b] = static_cast<char>(checkSums[i] >> (b * 8));
+            w.bytes(std::string_view(check, 8));
+        }
+    }
+
+    // Subtracts the cells of a peer's table of the same size, as read by parseCells()
+    void subtract(std::string_view cells) {
+        Reader r(cells);
+
+        for (uint64_t i = 0; i < numCells; i++) {
+            uint64_t zigzag = r.varInt();
+            counts[i] -= static_cast<int64_t>(zigzag >> 1) ^ -static_cast<int64_t>(zigzag & 1);
+
+            auto keySum = r.bytes(idSize);
+            for (uint64_t b = 0; b < idSize; b++) keySums[i * idSize + b] ^= keySum[b];
+
+            checkSums[i] ^= loadLE64(r.bytes(8).data());
+        }
+    }
+
+    // Returns a view of numCells encoded cells, checking they are all there
+    static std::string_view parseCells(Reader &r, uint64_t idSize, uint64_t numCells) {
+        if (numCells > MaxCells) throw negentropy::err("IBLT too large");
+        const char *begin = r.p;
+
+        for (uint64_t i = 0; i < numCells; i++) {
+            r.varInt();
+            r.bytes(idSize + 8);
+        }
+
+        return std::string_view(begin, r.p - begin);
+    }
+
+    // Peels the difference off, calling onId(id, count) with count 1 for ids that were added, and -1 for ones that
+    // were subtracted. Returns false if the table could not be emptied, in which case only some have been found.
+    template <typename F>
+    bool peel(F onId) {
+        pure.clear();
+        for (uint64_t i = 0; i < numCells; i++) {
+            if (isPure(i)) pure.push_back(i);
+        }
+
+        uint64_t numPeeled = 0;
+
+        while (pure.size()) {
+            uint64_t cell = pure.back();
+            pure.pop_back();
+            if (!isPure(cell)) continue; // emptied since
+            if (++numPeeled > numCells) return false;
+
+            char id[32];
+            memcpy(id, keySums.data() + cell * idSize, idSize);
+            int64_t count = counts[cell];
+            onId(std::string_view(id, idSize), count);
+
+            add(id, -count);
+
+            uint64_t h = hash(id);
+            for (uint64_t j = 0; j < 3; j++) {
+                uint64_t other = cellOf(h, j);
+                if (isPure(other)) pure.push_back(other);
+            }
+        }
+
+        for (uint64_t i = 0; i < numCells; i++) {
+            if (counts[i] || checkSums[i]) return false;
+        }
+
+        return std::all_of(keySums.begin(), keySums.end(), [](char c){ return c == '\0'; });
+    }
+
+  private:
+    std::pmr::vector<uint64_t> pure;
+
+    bool isPure(uint64_t c) const {
+        return (counts[c] == 1 || counts[c] == -1) && checkSums[c] == checkHash(hash(keySums.data() + c * idSize));
+    }
+
+    static uint64_t loadLE64(const char *p) {
+        uint64_t w = 0;
+        for (uint64_t b = 0; b < 8; b++) w |= uint64_t(uint8_t(p[b])) << (b * 8);
+        return w;
+    }
+
+    // The cell in subtable j: 21 bits of the hash per subtable, modulo its size
+    uint64_t cellOf(uint64_t h, uint64_t j) const {
+        uint64_t subtableSize = numCells / 3;
+        return j * subtableSize + ((h >> (j * 21)) & 0x1FFFFF) % subtableSize;
+    }
+
+    void xorId(char *keySum, const char *id) const {
+        uint64_t i = 0;
+
+        for (; i + 8 <= idSize; i += 8) {
+            uint64_t a, b;
+            memcpy(&a, keySum + i, 8);
+            memcpy(&b, id + i, 8);
+            a ^= b;
+            memcpy(keySum + i, &a, 8);
+        }
+
+        for (; i < idSize; i++) keySum[i] ^= id[i];
+    }
+
+    static uint64_t mix(uint64_t h) {
+        h ^= h >> 30;
+        h *= 0xBF58476D1CE4E5B9ULL;
+        h ^= h >> 27;
+        h *= 0x94D049BB133111EBULL;
+        h ^= h >> 31;
+        return h;
+    }
+
+    // The id read as little-endian 64-bit words (the last one ending at the id's end, shifted down past the bytes
+    // already read, if idSize isn't a multiple of 8), each XORed in and mixed
+    uint64_t hash(const char *id) const {
+        uint64_t h = 0x9E3779B97F4A7C15ULL;
+
+        for (uint64_t off = 0; off < idSize; off += 8) {
+            h ^= off + 8 <= idSize ? loadLE64(id + off) : loadLE64(id + idSize - 8) >> ((off + 8 - idSize) * 8);
+            h = mix(h);
+        }
+
+        return h;
+    }
+
+    static uint64_t checkHash(uint64_t h) {
+        return mix(h ^ 0x9E3779B97F4A7C15ULL);
+    }
+};
+
+
+// Receives a have or need id as soon as reconcile() finds it
+
+using IdCallback = std::function<void(std::string_view)>;
+
+
+// What a SplitPolicy knows about a range that differs
+
+struct SplitContext {
+    uint64_t numItems = 0; // our items in the range
+    uint64_t depth = 0; // messages exchanged before the one being built, each of which usually descends a level
+    uint64_t fingerprintsReceived = 0; // Fingerprint ranges in the message being answered
+    uint64_t fingerprintsDiffering = 0; // ... and how many of them differed from ours
+    const StorageBase *storage = nullptr;
+    uint64_t lower = 0; // the range's items are [lower, upper) in storage
+    uint64_t upper = 0;
+    uint64_t idSize = 0;
+    uint64_t frameBudget = MAX_U64; // estimated bytes this range may use in the next frame, or MAX_U64 for no limit
+};
+
+struct SplitBucket {
+    uint64_t end; // index of the item after the bucket
+    bool idList; // send the bucket's ids instead of its fingerprint
+};
+
+// Decides how a range that differs is split
+
+struct SplitPolicy {
+    virtual ~SplitPolicy() {}
+
+    // The number of buckets to split the range into (at most numItems), or 0 to send its ids as an IdList
+    virtual uint64_t buckets(const SplitContext &ctx) const {
+        return ctx.numItems < 32 ? 0 : 16;
+    }
+
+    // Appends the buckets in order, the last ending at ctx.upper, or nothing to send the whole range as an IdList.
+    // By default, buckets(ctx) buckets with equal numbers of items.
+    virtual void split(const SplitContext &ctx, std::pmr::vector<SplitBucket> &out) const {
+        splitEvenly(ctx.lower, ctx.upper, std::min(buckets(ctx), ctx.numItems), out);
+    }
+
+    // Estimated encoded sizes, for planning against ctx.frameBudget
+    static uint64_t fingerprintBytes(uint64_t idSize) {
+        return idSize + 8;
+    }
+
+    static uint64_t idListBytes(uint64_t idSize, uint64_t numItems) {
+        return numItems * idSize + 12;
+    }
+
+    static constexpr uint64_t PeerIdListItems = 16; // half the default threshold, so both sides' counts are below it
+
+    static void splitEvenly(uint64_t lower, uint64_t upper, uint64_t numBuckets, std::pmr::vector<SplitBucket> &out) {
+        if (numBuckets < 2) return;
+
+        uint64_t itemsPerBucket = (upper - lower) / numBuckets;
+        uint64_t bucketsWithExtra = (upper - lower) % numBuckets;
+
+        for (uint64_t i = 0; i < numBuckets; i++) {
+            lower += itemsPerBucket + (i < bucketsWithExtra ? 1 : 0);
+            out.push_back({ lower, false });
+        }
+    }
+};
+
+// Always the same number of buckets, and IdLists below twice that many items
+
+struct FixedSplitPolicy : SplitPolicy {
+    uint64_t numBuckets;
+
+    FixedSplitPolicy(uint64_t numBuckets) : numBuckets(numBuckets) {
+        if (numBuckets < 2) throw negentropy::err("numBuckets invalid");
+    }
+
+    uint64_t buckets(const SplitContext &ctx) const override {
+        return ctx.numItems < numBuckets * 2 ? 0 : numBuckets;
+    }
+};
+
+// Adapts to how dense the differences are, judged by how many of the peer's fingerprints differed. When few
+// did, each differing range probably holds only one or two differences, so it descends in as few levels as
+// maxBuckets allows, with equal fan-out per level, unless minBuckets would finish in as few messages. When most
+// did, the next level's fingerprints would mostly differ too, so larger ranges go straight to IdLists.
+
+struct AdaptiveSplitPolicy : SplitPolicy {
+    uint64_t minBuckets = 16;
+    uint64_t maxBuckets = 128;
+    uint64_t idListThreshold = 32; // send an IdList below this many items
+    uint64_t denseIdListThreshold = 256; // ... or below this many, when differences are dense
+    double denseFraction = 0.5; // differing fingerprints above which differences count as dense
+
+    uint64_t buckets(const SplitContext &ctx) const override {
+        bool dense = ctx.fingerprintsReceived && ctx.fingerprintsDiffering > denseFraction * ctx.fingerprintsReceived;
+
+        if (ctx.numItems < (dense ? denseIdListThreshold : idListThreshold)) return 0;
+        if (dense) return std::min(minBuckets, ctx.numItems);
+
+        // Fewest levels of at most maxBuckets each that get down to half the IdList threshold (so the last level is
+        // below it on both sides, even if their counts differ a little), then the fan-out that needs
+        double ratio = 2.0 * ctx.numItems / idListThreshold;
+        double levels = std::max(std::ceil(std::log(ratio) / std::log(double(maxBuckets))), 1.0);
+        auto b = uint64_t(std::ceil(std::pow(ratio, 1.0 / levels)));
+
+        // Wider buckets cost bytes, so only use them if they end the exchange sooner than minBuckets would
+        uint64_t minLevels = 0;
+        for (uint64_t n = ctx.numItems; n >= idListThreshold; n = (n + minBuckets - 1) / minBuckets) minLevels++;
+        if (lastMessage(ctx.depth + minLevels) <= lastMessage(ctx.depth + uint64_t(levels))) b = minBuckets;
+
+        return std::min(std::clamp(b, minBuckets, maxBuckets), ctx.numItems);
+    }
+
+  private:
+    // The exchange ends with the server's message: either its IdLists, or its answer to the client's
+    static uint64_t lastMessage(uint64_t idListDepth) {
+        return idListDepth % 2 ? idListDepth : idListDepth + 1;
+    }
+};
+
+// Trades bandwidth for round trips. Each Fingerprint bucket chosen by inner is split again by inner, for up to
+// extraLevels more levels, so that a difference deeper down can be narrowed without waiting a round trip per
+// level. The receiver sees ordinary contiguous ranges. The buckets sent for a range are capped by byteBudget,
+// shared between the ranges split in the same message, and by the range's share of the frame under a frame size
+// limit. Buckets past the cap stay unsplit.
+
+struct SpeculativeSplitPolicy : SplitPolicy {
+    std::shared_ptr<const SplitPolicy> inner;
+    uint64_t extraLevels;
+    uint64_t byteBudget;
+
+    SpeculativeSplitPolicy(std::shared_ptr<const SplitPolicy> inner = nullptr, uint64_t extraLevels = 1, uint64_t byteBudget = 65536)
+        : inner(inner ? std::move(inner) : std::make_shared<SplitPolicy>()), extraLevels(extraLevels), byteBudget(byteBudget) {}
+
+    uint64_t buckets(const SplitContext &ctx) const override {
+        return inner->buckets(ctx);
+    }
+
+    void split(const SplitContext &ctx, std::pmr::vector<SplitBucket> &out) const override {
+        inner->split(ctx, out);
+        if (out.empty()) return;
+
+        uint64_t budget = std::min(byteBudget / std::max(ctx.fingerprintsDiffering, uint64_t(1)), ctx.frameBudget);
+        uint64_t maxBuckets = budget / fingerprintBytes(ctx.idSize);
+
+        std::pmr::vector<SplitBucket> next(out.get_allocator()), sub(out.get_allocator());
+        SplitContext subCtx = ctx;
+
+        for (uint64_t level = 1; level <= extraLevels && out.size() < maxBuckets; level++) {
+            subCtx.depth = ctx.depth + 2 * level;
+            uint64_t numBuckets = out.size();
+            uint64_t prev = ctx.lower;
+            next.clear();
+
+            for (const auto &b : out) {
+                sub.clear();
+
+                if (!b.idList) {
+                    subCtx.lower = prev;
+                    subCtx.upper = b.end;
+                    subCtx.numItems = b.end - prev;
+                    inner->split(subCtx, sub);
+                }
+
+                if (sub.size() < 2 || numBuckets + sub.size() - 1 > maxBuckets) {
+                    next.push_back(b);
+                } else {
+                    next.insert(next.end(), sub.begin(), sub.end());
+                    numBuckets += sub.size() - 1;
+                }
+
+                prev = b.end;
+            }
+
+            if (next.size() == out.size()) break;
+            std::swap(out, next);
+        }
+    }
+};
+
+// For sets where differences are mostly among the newest items. Bucket boundaries go at timestamps whose age
+// (relative to the newest item) doubles from one to the next, starting at the age of the recentIdListLimit newest
+// items, so recent data is split finely. The newest bucket is sent as an IdList straight away, so differences
+// among those items are found in one round trip. Age bands are only used in ranges with recent items, and while
+// they are narrower than the buckets of a FixedSplitPolicy. Older items, and ranges with no recent items, are split
+// evenly into buckets no wider than that, so differences there take no more round trips than with the default
+// split. The timestamp
+// distribution comes from the sorted storage itself, so it needs no separate histogram.
+
+struct RecencySplitPolicy : SplitPolicy {
+    uint64_t recentIdListLimit = 256; // most items in the newest bucket, which is sent as an IdList straight away
+    uint64_t idListThreshold = 32; // smaller buckets are sent as IdLists too
+    uint64_t maxBands = 16; // age bands, besides the even buckets
+    FixedSplitPolicy fixed{16};
+
+    uint64_t buckets(const SplitContext &ctx) const override {
+        return fixed.buckets(ctx);
+    }
+
+    void split(const SplitContext &ctx, std::pmr::vector<SplitBucket> &out) const override {
+        const auto &storage = *ctx.storage;
+        uint64_t numItems = storage.size();
+        uint64_t numFixed = fixed.buckets(ctx);
+        if (ctx.numItems < idListThreshold || numFixed == 0) return;
+
+        uint64_t newest = storage.getItem(numItems - 1).timestamp;
+        uint64_t window = std::max(newest - storage.getItem(numItems - std::min(recentIdListLimit, numItems)).timestamp, uint64_t(1));
+        uint64_t first = storage.getItem(ctx.lower).timestamp;
+        uint64_t last = storage.getItem(ctx.upper - 1).timestamp;
+
+        if (last <= newest - window) { // no recent items
+            fixed.split(ctx, out);
+            return;
+        }
+
+        // Starts of the age bands within the range, newest first, while they are no wider than a fixed bucket (or
+        // for the newest, than recentIdListLimit)
+        uint64_t fixedItems = (ctx.numItems + numFixed - 1) / numFixed;
+        uint64_t starts[64];
+        uint64_t numBands = 0;
+        uint64_t bandEnd = ctx.upper;
+
+        for (uint64_t age = window; numBands < std::min(maxBands, uint64_t(64)); age *= 2) {
+            if (age > newest) break;
+            uint64_t ts = newest - age + 1; // items at ts or newer are within age
+            if (ts <= first) break;
+            if (ts <= last) {
+                uint64_t start = storage.findUpperBound(ctx.lower, bandEnd, XorElem(ts, ""));
+                if (bandEnd - start > (numBands ? fixedItems : std::max(fixedItems, recentIdListLimit))) break;
+                if (start < bandEnd) starts[numBands++] = bandEnd = start;
+            }
+            if (age > MAX_U64 / 2) break;
+        }
+
+        if (numBands == 0) {
+            fixed.split(ctx, out);
+            return;
+        }
+
+        // Older items in even buckets, then the bands, oldest first
+        if (uint64_t older = bandEnd - ctx.lower) {
+            uint64_t numEven = (older + fixedItems - 1) / fixedItems;
+            if (numEven < 2) out.push_back({ bandEnd, older < idListThreshold });
+            else splitEvenly(ctx.lower, bandEnd, numEven, out);
+        }
+
+        for (uint64_t i = numBands; i-- > 0; ) {
+            uint64_t end = i ? starts[i - 1] : ctx.upper;
+            bool recent = storage.getItem(starts[i]).timestamp > newest - window;
+            out.push_back({ end, end - starts[i] < idListThreshold || (recent && end - starts[i] <= recentIdListLimit) });
+        }
+
+        if (out.size() == 1) {
+            out.clear();
+            fixed.split(ctx, out);
+        }
+    }
+};
+
+
+// Options for the IBLT mode, in which a server answers a large differing range with an IBLT of it rather than
+// splitting it, so that a client can often decode the few differences within it straight away. Clients advertise
+// support in each message, so it is only used when both peers enable it. The table is sized by estimating the
+// differences per differing range from how many of the peer's fingerprints differed, and isn't used when they all
+// did, since the differences are then probably too dense to decode. Clients stop advertising once an IBLT fails to
+// decode, since the differences are then too dense or clustered for the estimate, and split the failed range straight
+// into buckets small enough to be answered with IdLists, so a failure costs no more round trips than splitting would.
+//
+// The trade-off is CPU for round trips: both peers hash every item in the range, so reconciling costs about 30-45 ns
+// per item where splitting costs 4-5 (bench, 100k-10M items), in return for one round trip instead of two or three
+// when the differences are sparse. Enable it where latency dominates, and leave it off for servers that are CPU bound.
+
+struct IbltOptions {
+    uint64_t minItems = 1024; // smaller ranges are split as usual
+    uint64_t minCells = 30;
+    double cellsPerDifference = 6;
+    uint64_t fallbackBuckets = 256; // most buckets a client splits a range into when its IBLT fails to decode
+};
+
+
+// The protocol engine, with idSize fixed at compile time (IdSize 0 = any idSize, given at runtime), and by
+// default the number of buckets a differing range is split into (see setSplitPolicy()). Negentropy dispatches
+// to an instantiation for idSizes 8, 16 and 32.
+
+template <uint64_t IdSize, uint64_t Buckets = 16>
+struct BasicNegentropy : IdSizeField<IdSize> {
+    using IdSizeField<IdSize>::idSize;
+
+    static_assert(IdSize == 0 || (IdSize >= 8 && IdSize <= 32), "IdSize invalid");
+    static_assert(Buckets >= 2, "Buckets invalid");
+
+    // An output range. Fingerprints and IdLists are rendered from the items within its bounds when it is sent,
+    // so a deferred range costs no more than its descriptor and (usually shared) bounds, and reflects any items
+    // inserted or erased in the meantime.
+    struct BoundOutput {
+        uint64_t start; // offsets of the bounds in payloadBuffer, see storeBound()
+        uint64_t end;
+        uint64_t mode; // 1 = Fingerprint, 2 = IdList, 3 = IdListResponse, 4 = IBLT
+        uint64_t lower; // indices of the items within the bounds, or NoIndex if the storage changed since
+        uint64_t upper;
+        uint64_t payloadOffset; // IdListResponse: rendered when the IdList was received, into payloadBuffer. IBLT: number of cells.
+        uint64_t payloadSize;
+    };
+
+    static constexpr uint64_t NoIndex = MAX_U64;
+
+    std::shared_ptr<const StorageBase> storagePtr;
+    bool isInitiator = false;
+    uint64_t frameSizeLimit = 0;
+
+    // Outputs waiting to be sent, in reverse order (back() is next). Their bounds and any pre-rendered payloads
+    // live in payloadBuffer, and both are reused between messages so steady-state rounds don't allocate per
+    // range or per field.
+    std::pmr::vector<BoundOutput> pendingOutputs;
+    std::pmr::string payloadBuffer;
+    std::pmr::string compactionBuffer;
+
+    // A decoded range of an incoming message. Views point into the message.
+    struct IncomingRange {
+        XorElem bound;
+        uint64_t mode; // 0 = Skip, 1 = Fingerprint, 2 = IdList, 3 = IdListResponse, 4 = IBLT
+        std::string_view payload; // fingerprint, packed ids for IdList/IdListResponse, or encoded cells for IBLT
+        std::string_view bitField; // IdListResponse only
+        uint64_t numCells; // IBLT only
+        uint64_t upper; // index of the first of our items after the bound
+        bool differs; // Fingerprint only
+    };
+
+    // Working state of a single initiate() or reconcile() call, allocated from the round arena
+    struct RoundScratch {
+        std::pmr::vector<IncomingRange> incomingRanges;
+        std::pmr::vector<BoundOutput> newOutputs;
+        std::pmr::string scratchIds;
+        std::pmr::vector<uint64_t> scratchIndices;
+        IdListTable<IdSize> idListTable;
+        std::pmr::vector<SplitBucket> buckets;
+        std::pmr::vector<BoundOutput> spareOutputs; // for merging and deferring pending outputs
+        Iblt<IdSize> iblt;
+
+        RoundScratch(uint64_t idSize, std::pmr::memory_resource *resource) : incomingRanges(resource), newOutputs(resource), scratchIds(resource), scratchIndices(resource), idListTable(idSize, resource), buckets(resource), spareOutputs(resource), iblt(idSize, resource) {
+        }
+    };
+
+    // The session's buffers come from resource, which must outlive it (and be thread-safe if sessions sharing
+    // it run concurrently). Per-message scratch comes from an arena on top of it.
+    BasicNegentropy(uint64_t idSize_, std::shared_ptr<const StorageBase> storage, std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+        : IdSizeField<IdSize>(idSize_), storagePtr(std::move(storage)), pendingOutputs(resource), payloadBuffer(resource), compactionBuffer(resource), arena(std::make_unique<RoundArena>(resource)) {
+        if (idSize < 8 || idSize > 32) throw negentropy::err("idSize invalid");
+        if (!storagePtr) throw negentropy::err("null storage");
+    }
+
+    const StorageBase &storage() const {
+        return *storagePtr;
+    }
+
+    // Clears all per-session protocol state so the object can be reused for a new session,
+    // optionally against a different storage
+    void reset() {
+        isInitiator = false;
+        frameSizeLimit = 0;
+        numMessages = 0;
+        peerIblt = false;
+        ibltFailed = false;
+        pendingOutputs.clear();
+        payloadBuffer.clear();
+    }
+
+    // Replaces the default FixedSplitPolicy(Buckets). Kept across reset().
+    void setSplitPolicy(std::shared_ptr<const SplitPolicy> policy) {
+        splitPolicy = std::move(policy);
+    }
+
+    // Enables the IBLT mode (see IbltOptions), or disables it with std::nullopt. Kept across reset().
+    void setIblt(std::optional<IbltOptions> options) {
+        ibltOptions = options;
+    }
+
+    void reset(std::shared_ptr<const StorageBase> storage) {
+        if (!storage) throw negentropy::err("null storage");
+        reset();
+        storagePtr = std::move(storage);
+    }
+
+    std::string initiate(uint64_t frameSizeLimit_ = 0) {
+        Round r(*this);
+        initiateAux(frameSizeLimit_);
+        return buildOutput();
+    }
+
+    std::string reconcile(std::string_view query) {
+        if (isInitiator) throw negentropy::err("initiator not asking for have/need IDs");
+        std::vector<std::string> haveIds, needIds;
+        Round r(*this);
+        reconcileAux(query, haveIds, needIds);
+        return buildOutput();
+    }
+
+    std::string reconcile(std::string_view query, std::vector<std::string> &haveIds, std::vector<std::string> &needIds) {
+        if (!isInitiator) throw negentropy::err("non-initiator asking for have/need IDs");
+        Round r(*this);
+        reconcileAux(query, haveIds, needIds);
+        return buildOutput();
+    }
+
+    // As above, with the ids allocated from the vectors' resource
+    std::string reconcile(std::string_view query, std::pmr::vector<std::pmr::string> &haveIds, std::pmr::vector<std::pmr::string> &needIds) {
+        if (!isInitiator) throw negentropy::err("non-initiator asking for have/need IDs");
+        Round r(*this);
+        reconcileAux(query, haveIds, needIds);
+        return buildOutput();
+    }
+
+    // As above, but passing each id to a callback as soon as it is found instead of collecting them. The views
+    // point into the query or our storage, and are only valid during the callback.
+    std::string reconcile(std::string_view query, const IdCallback &onHave, const IdCallback &onNeed) {
+        if (!isInitiator) throw negentropy::err("non-initiator asking for have/need IDs");
+        Round r(*this);
+        reconcileAux(query, onHave, onNeed);
+        return buildOutput();
+    }
+
+    // As above, but writing the message to output as slices that reference ids in the storage, see OutputSlices
+
+    void initiate(OutputSlices &output, uint64_t frameSizeLimit_ = 0) {
+        Round r(*this);
+        initiateAux(frameSizeLimit_);
+        buildOutput(output);
+    }
+
+    void reconcile(std::string_view query, OutputSlices &output) {
+        if (isInitiator) throw negentropy::err("initiator not asking for have/need IDs");
+        std::vector<std::string> haveIds, needIds;
+        Round r(*this);
+        reconcileAux(query, haveIds, needIds);
+        buildOutput(output);
+    }
+
+    // haveIds and needIds are vectors or callbacks, as above
+    template <typename Have, typename Need>
+    void reconcile(std::string_view query, Have &&haveIds, Need &&needIds, OutputSlices &output) {
+        if (!isInitiator) throw negentropy::err("non-initiator asking for have/need IDs");
+        Round r(*this);
+        reconcileAux(query, haveIds, needIds);
+        buildOutput(output);
+    }
+
+  private:
+    std::unique_ptr<RoundArena> arena; // behind a pointer so that sessions stay movable
+    RoundScratch *round = nullptr;
+    uint64_t storageGeneration = 0;
+    std::shared_ptr<const SplitPolicy> splitPolicy;
+    uint64_t numMessages = 0; // received
+    SplitContext splitContext{};
+
+    std::optional<IbltOptions> ibltOptions;
+    bool peerIblt = false; // the message being answered advertised the IBLT mode
+    bool ibltFailed = false; // an IBLT failed to decode, so the differences are too dense or clustered for them
+
+    // With a frame size limit: the estimated size of the next message as planned so far, and how many of the
+    // differing ranges being answered are still to be split
+    uint64_t framePlanned = 0;
+    uint64_t rangesToSplit = 0;
+
+    // Item indices remembered in pendingOutputs are stale once the storage changes
+    void checkStorageGeneration() {
+        uint64_t generation = storage().generation();
+        if (generation == storageGeneration) return;
+
+        for (auto &p : pendingOutputs) p.lower = p.upper = NoIndex;
+        storageGeneration = generation;
+    }
+
+    // Scopes a RoundScratch to one call. The arena is reset after the scratch is destroyed, even on error.
+    struct Round {
+        BasicNegentropy &s;
+        RoundArena::Scope scope;
+        RoundScratch scratch;
+
+        Round(BasicNegentropy &s) : s(s), scope(*s.arena), scratch(s.idSize, scope.resource) {
+            s.round = &scratch;
+            s.checkStorageGeneration();
+        }
+
+        ~Round() {
+            s.round = nullptr;
+        }
+    };
+
+    void initiateAux(uint64_t frameSizeLimit_) {
+        isInitiator = true;
+
+        if (frameSizeLimit_ != 0 && frameSizeLimit_ < 1024) throw negentropy::err("frameSizeLimit too small");
+        frameSizeLimit = frameSizeLimit_;
+        numMessages = 0;
+
+        splitContext = SplitContext{};
+        startFramePlan();
+        splitRange(0, storage().size(), XorElem(0, ""), XorElem(MAX_U64, ""));
+        queueNewOutputs();
+    }
+
+    template <typename Sink>
+    static void addId(Sink &sink, std::string_view id) {
+        if constexpr (std::is_invocable_v<Sink &, std::string_view>) sink(id);
+        else sink.emplace_back(id);
+    }
+
+    template <typename Have, typename Need>
+    void reconcileAux(std::string_view query, Have &haveIds, Need &needIds) {
+        const auto &storage = this->storage();
+        auto &scratch = *round;
+
+        // Decode the whole message first, then locate every range in our storage, then process them
+
+        parseRanges(query);
+
+        peerIblt = !isInitiator && scratch.incomingRanges.size() && scratch.incomingRanges[0].mode == 0 && scratch.incomingRanges[0].bound == ibltMarker();
+
+        uint64_t prevIndex = 0;
+        for (auto &r : scratch.incomingRanges) prevIndex = r.upper = storage.findUpperBound(prevIndex, storage.size(), r.bound);
+
+        // Compare fingerprints up front, so that the split policy knows how many differ
+
+        numMessages++;
+        splitContext = SplitContext{ .depth = numMessages * 2 - (isInitiator ? 0 : 1) };
+        prevIndex = 0;
+
+        for (auto &r : scratch.incomingRanges) {
+            if (r.mode == 1) {
+                XorElem ourXorSet = storage.fingerprint(prevIndex, r.upper);
+                r.differs = memcmp(r.payload.data(), ourXorSet.id, idSize) != 0;
+                splitContext.fingerprintsReceived++;
+                splitContext.fingerprintsDiffering += r.differs;
+            }
+
+            prevIndex = r.upper;
+        }
+
+        startFramePlan();
+
+        auto prevBound = XorElem(0, "");
+        prevIndex = 0;
+
+        for (const auto &r : scratch.incomingRanges) {
+            const auto &currBound = r.bound;
+            auto mode = r.mode;
+            auto lower = prevIndex;
+            auto upper = r.upper;
+
+            if (mode == 0) { // Skip
+                // Do nothing
+            } else if (mode == 1) { // Fingerprint
+                if (r.differs) splitRange(lower, upper, prevBound, currBound);
+            } else if (mode == 2) { // IdList
+                scratch.idListTable.build(r.payload);
+
+                scratch.scratchIds.clear();
+                scratch.scratchIndices.clear();
+
+                // Passed by std::ref so std::function doesn't allocate for the captures
+                auto onItem = [&](const XorElem &item, uint64_t){
+                    if (scratch.idListTable.mark(item.id)) return; // ID exists on both sides
+
+                    // ID exists on our side, but not their side
+                    if (isInitiator) addId(haveIds, item.getId());
+                    else scratch.scratchIds += item.getId();
+                };
+
+                storage.iterate(lower, upper, std::ref(onItem));
+
+                for (uint64_t i = 0; i < scratch.idListTable.found.size(); i++) {
+                    if (!scratch.idListTable.found[i]) {
+                        // ID exists on their side, but not our side
+                        if (isInitiator) addId(needIds, r.payload.substr(i * idSize, idSize));
+                        else scratch.scratchIndices.emplace_back(i);
+                    }
+                }
+
+                if (!isInitiator) {
+                    uint64_t payloadOffset = payloadBuffer.size();
+                    Writer w{payloadBuffer};
+
+                    w.varInt(3); // mode = IdListResponse
+
+                    w.varInt(scratch.scratchIds.size() / idSize);
+                    w.bytes(scratch.scratchIds);
+
+                    encodeBitField(w, scratch.scratchIndices);
+
+                    uint64_t payloadSize = payloadBuffer.size() - payloadOffset;
+                    uint64_t start = storeBound(prevBound);
+                    addOutput(start, storeBound(currBound), 3, NoIndex, NoIndex, payloadOffset, payloadSize);
+                }
+            } else if (mode == 3) { // IdListResponse
+                for (uint64_t i = 0; i < r.payload.size(); i += idSize) {
+                    addId(needIds, r.payload.substr(i, idSize));
+                }
+
+                auto onItem = [&](const XorElem &item, uint64_t index){
+                    if (bitFieldLookup(r.bitField, index - lower)) addId(haveIds, item.getId());
+                };
+
+                storage.iterate(lower, upper, std::ref(onItem));
+            } else if (mode == 4) { // IBLT
+                auto &iblt = scratch.iblt;
+                iblt.reset(r.numCells);
+
+                auto onItem = [&](const XorElem &item, uint64_t){
+                    iblt.add(item.id, 1);
+                };
+
+                storage.iterate(lower, upper, std::ref(onItem));
+                iblt.subtract(r.payload);
+
+                // Nothing is reported unless the whole difference decodes
+                scratch.scratchIds.clear();
+                scratch.scratchIndices.clear();
+
+                bool decoded = iblt.peel([&](std::string_view id, int64_t count){
+                    scratch.scratchIds += id;
+                    scratch.scratchIndices.push_back(count > 0);
+                });
+
+                if (decoded) {
+                    for (uint64_t i = 0; i < scratch.scratchIndices.size(); i++) {
+                        auto id = std::string_view(scratch.scratchIds).substr(i * idSize, idSize);
+                        if (scratch.scratchIndices[i]) addId(haveIds, id);
+                        else addId(needIds, id);
+                    }
+                } else {
+                    // The range holds more differences than the table could decode, so rather than descend a level
+                    // at a time, split it into buckets small enough for the server to answer with IdLists
+                    ibltFailed = true;
+                    uint64_t fallbackBuckets = ibltOptions ? ibltOptions->fallbackBuckets : IbltOptions{}.fallbackBuckets;
+                    splitRange(lower, upper, prevBound, currBound, std::min((upper - lower + SplitPolicy::PeerIdListItems - 1) / SplitPolicy::PeerIdListItems, fallbackBuckets));
+                }
+            }
+
+            prevIndex = upper;
+            prevBound = currBound;
+        }
+
+        queueNewOutputs();
+    }
+
+    void parseRanges(std::string_view query) {
+        Reader reader(query);
+        uint64_t lastTimestampIn = 0;
+        round->incomingRanges.clear();
+
+        while (!reader.empty()) {
+            auto &r = round->incomingRanges.emplace_back();
+            r.bound = decodeBound(reader, lastTimestampIn);
+            r.mode = reader.varInt();
+
+            if (r.mode == 0) { // Skip
+                // No payload
+            } else if (r.mode == 1) { // Fingerprint
+                r.payload = reader.bytes(idSize);
+            } else if (r.mode == 2) { // IdList
+                auto numIds = reader.varInt();
+                r.payload = reader.bytes(numIds, idSize);
+            } else if (r.mode == 3) { // IdListResponse
+                if (!isInitiator) throw negentropy::err("unexpected IdListResponse");
+
+                auto numIds = reader.varInt();
+                r.payload = reader.bytes(numIds, idSize);
+
+                auto bitFieldSize = reader.varInt();
+                r.bitField = reader.bytes(bitFieldSize);
+            } else if (r.mode == 4) { // IBLT
+                if (!isInitiator) throw negentropy::err("unexpected IBLT");
+
+                r.numCells = reader.varInt();
+                r.payload = Iblt<IdSize>::parseCells(reader, idSize, r.numCells);
+            } else {
+                throw negentropy::err("unexpected mode");
+            }
+        }
+    }
+
+    // The number of cells for an IBLT of a differing range, or 0 to split it as usual
+    uint64_t ibltCells(uint64_t numElems) const {
+        if (!ibltOptions || !peerIblt || numElems < ibltOptions->minItems) return 0;
+
+        uint64_t received = splitContext.fingerprintsReceived, differing = splitContext.fingerprintsDiffering;
+        if (!received || differing >= received) return 0;
+
+        // Differences per range are roughly Poisson distributed: the fraction of ranges that differ gives the rate,
+        // and from that the expected number of differences in one that differs
+        double fraction = double(differing) / received;
+        double expected = -std::log(1 - fraction) / fraction;
+
+        uint64_t numCells = std::max(ibltOptions->minCells, uint64_t(std::ceil(ibltOptions->cellsPerDifference * expected)));
+        return std::min((numCells + 2) / 3 * 3, Iblt<IdSize>::MaxCells);
+    }
+
+    // Clients advertise the IBLT mode with an empty Skip range ending at (0, "\0") before anything else, which peers
+    // without it just skip. No minimal bound is ever all zero bytes, so it can't be mistaken for one.
+    static XorElem ibltMarker() {
+        return XorElem(0, std::string_view("\0", 1));
+    }
+
+    void startFramePlan() {
+        framePlanned = 0;
+        rangesToSplit = 0;
+        if (!frameSizeLimit) return;
+
+        for (const auto &p : pendingOutputs) framePlanned += outputBytes(p);
+        rangesToSplit = splitContext.fingerprintsDiffering;
+
+        // IBLTs that fail to decode are split too
+        for (const auto &r : round->incomingRanges) rangesToSplit += r.mode == 4;
+    }
+
+    uint64_t outputBytes(const BoundOutput &p) const {
+        if (p.mode == 1) return SplitPolicy::fingerprintBytes(idSize);
+        if (p.mode == 2) return SplitPolicy::idListBytes(idSize, p.upper != NoIndex ? p.upper - p.lower : 2 * Buckets);
+        if (p.mode == 4) return Iblt<IdSize>::encodedSize(idSize, p.payloadOffset) + 8;
+        return p.payloadSize + 8;
+    }
+
+    uint64_t minOutputBytes(const BoundOutput &p) const {
+        if (p.mode == 1) return idSize + 3;
+        if (p.mode == 2) return (p.upper != NoIndex ? p.upper - p.lower : 0) * idSize + 4;
+        if (p.mode == 4) return Iblt<IdSize>::encodedSize(idSize, p.payloadOffset) + 3;
+        return p.payloadSize + 2;
+    }
+
+    // Splits a range that differs as the policy decides, or into numBuckets even buckets if given
+    void splitRange(uint64_t lower, uint64_t upper, const XorElem &lowerBound, const XorElem &upperBound, uint64_t numBuckets = 0) {
+        const auto &storage = this->storage();
+        uint64_t numElems = upper - lower;
+        uint64_t start = storeBound(lowerBound);
+        auto &buckets = round->buckets;
+        buckets.clear();
+
+        // With a frame size limit, each range that is known to differ gets an even share of what is left of the
+        // next frame, for deciding whether its IdList fits and how far a policy may split it. The initial split
+        // gets the whole frame.
+        uint64_t frameBudget = MAX_U64;
+        if (rangesToSplit) {
+            frameBudget = (frameSizeLimit > framePlanned ? frameSizeLimit - framePlanned : 0) / rangesToSplit;
+            rangesToSplit--;
+        } else if (frameSizeLimit) {
+            frameBudget = frameSizeLimit > framePlanned ? frameSizeLimit - framePlanned : 0;
+        }
+
+        splitContext.numItems = numElems;
+        splitContext.storage = &storage;
+        splitContext.lower = lower;
+        splitContext.upper = upper;
+        splitContext.idSize = idSize;
+        splitContext.frameBudget = frameBudget;
+
+        if (uint64_t numCells = ibltCells(numElems)) {
+            addOutput(start, storeBound(upperBound), 4, lower, upper, numCells);
+            return;
+        }
+
+        if (numBuckets) {
+            if (frameBudget != MAX_U64) numBuckets = std::min(numBuckets, frameBudget / SplitPolicy::fingerprintBytes(idSize));
+            SplitPolicy::splitEvenly(lower, upper, std::min(numBuckets, numElems), buckets);
+        } else if (splitPolicy) {
+            splitPolicy->split(splitContext, buckets);
+
+            uint64_t prev = lower;
+            for (const auto &b : buckets) {
+                if (b.end <= prev || b.end > upper) throw negentropy::err("invalid split");
+                prev = b.end;
+            }
+            if (buckets.size() && prev != upper) throw negentropy::err("invalid split");
+        } else if (numElems >= Buckets * 2) {
+            SplitPolicy::splitEvenly(lower, upper, Buckets, buckets);
+        }
+
+        // An IdList must fit in a frame on its own, or it could never be sent
+        uint64_t maxIdListItems = frameSizeLimit ? frameSizeLimit / 2 / idSize : MAX_U64;
+
+        if (buckets.size() < 2 && numElems > maxIdListItems) {
+            buckets.clear();
+            SplitPolicy::splitEvenly(lower, upper, Buckets, buckets);
+        }
+
+        // A single Fingerprint bucket would just repeat the range
+        if (buckets.size() < 2) buckets.clear();
+
+        // With a frame size limit, our frames are the bottleneck. When an IdList wouldn't fit in the range's share,
+        // Fingerprints of buckets small enough for the peer to answer with IdLists resolve the range after just as
+        // many messages, in a fraction of the frame. The peer is never frame-limited, so it doesn't do the same in
+        // return.
+        if (buckets.empty() && frameBudget != MAX_U64 && SplitPolicy::idListBytes(idSize, numElems) > frameBudget) {
+            uint64_t numBuckets = (numElems + SplitPolicy::PeerIdListItems - 1) / SplitPolicy::PeerIdListItems;
+
+            if (numBuckets * SplitPolicy::fingerprintBytes(idSize) < SplitPolicy::idListBytes(idSize, numElems)) {
+                if (numBuckets == 1) buckets.push_back({ upper, false });
+                else SplitPolicy::splitEvenly(lower, upper, numBuckets, buckets);
+            }
+        }
+
+        if (buckets.empty()) {
+            addOutput(start, storeBound(upperBound), 2, lower, upper);
+            return;
+        }
+
+        auto curr = lower;
+
+        for (uint64_t i = 0; i < buckets.size(); i++) {
+            auto bucketEnd = buckets[i].end;
+            bool idList = buckets[i].idList && bucketEnd - curr <= maxIdListItems;
+            uint64_t end = storeBound(i == buckets.size() - 1 ? upperBound : getMinimalBound(storage.getItem(bucketEnd - 1), storage.getItem(bucketEnd)));
+            addOutput(start, end, idList ? 2 : 1, curr, bucketEnd);
+            start = end;
+            curr = bucketEnd;
+        }
+    }
+
+    void addOutput(uint64_t start, uint64_t end, uint64_t mode, uint64_t lower, uint64_t upper, uint64_t payloadOffset = 0, uint64_t payloadSize = 0) {
+        auto &p = round->newOutputs.emplace_back(BoundOutput({ start, end, mode, lower, upper, payloadOffset, payloadSize }));
+        if (frameSizeLimit) framePlanned += outputBytes(p);
+    }
+
+    // Outputs still pending from earlier messages cover other ranges than the new ones, so both are merged in bound
+    // order, and whatever comes first is sent in the next frame
+    void queueNewOutputs() {
+        auto &newOutputs = round->newOutputs;
+
+        if (pendingOutputs.empty()) {
+            pendingOutputs.insert(pendingOutputs.end(), newOutputs.rbegin(), newOutputs.rend());
+        } else if (newOutputs.size()) {
+            auto &merged = round->spareOutputs;
+            merged.clear();
+
+            auto a = pendingOutputs.begin();
+            auto b = newOutputs.rbegin();
+
+            while (a != pendingOutputs.end() && b != newOutputs.rend()) {
+                if (loadBound(b->start) < loadBound(a->start)) merged.push_back(*a++);
+                else merged.push_back(*b++);
+            }
+
+            merged.insert(merged.end(), a, pendingOutputs.end());
+            merged.insert(merged.end(), b, newOutputs.rend());
+            pendingOutputs.assign(merged.begin(), merged.end());
+        }
+
+        newOutputs.clear();
+    }
+
+    // Bounds are stored as an 8-byte timestamp, a length byte, and the id prefix
+
+    uint64_t storeBound(const XorElem &bound) {
+        uint64_t offset = payloadBuffer.size();
+        char header[9];
+        memcpy(header, &bound.timestamp, 8);
+        header[8] = static_cast<char>(bound.idSize);
+        payloadBuffer.append(header, sizeof(header));
+        payloadBuffer.append(bound.id, bound.idSize);
+        return offset;
+    }
+
+    XorElem loadBound(uint64_t offset) const {
+        uint64_t timestamp;
+        memcpy(&timestamp, payloadBuffer.data() + offset, 8);
+        return XorElem(timestamp, std::string_view(payloadBuffer.data() + offset + 9, boundSize(offset) - 9));
+    }
+
+    uint64_t boundSize(uint64_t offset) const {
+        return 9 + static_cast<uint8_t>(payloadBuffer[offset + 8]);
+    }
+
+    std::string buildOutput() {
+        std::string output;
+        buildOutput(output);
+        return output;
+    }
+
+    template <typename Out>
+    void buildOutput(Out &output) {
+        const auto &storage = this->storage();
+
+        // Bounds take at most 11 + idSize bytes, plus a Skip range for each gap between outputs
+        uint64_t expectedSize = 0;
+        for (auto it = pendingOutputs.rbegin(); it != pendingOutputs.rend(); ++it) {
+            expectedSize += 2 * idSize + 24 + (it->mode == 1 ? idSize : it->mode == 2 ? (it->upper != NoIndex ? it->upper - it->lower : 2 * Buckets) * idSize : it->mode == 4 ? outputBytes(*it) : it->payloadSize);
+            if (frameSizeLimit && expectedSize >= frameSizeLimit) {
+                expectedSize = frameSizeLimit;
+                break;
+            }
+        }
+
+        output.clear();
+        output.reserve(expectedSize);
+        Writer w{output};
+        auto currBound = XorElem(0, "");
+        uint64_t currIndex = 0; // no greater than the index of the first item at or after currBound
+        bool currIndexExact = true;
+        uint64_t lastTimestampOut = 0;
+        auto &deferred = round->spareOutputs;
+        deferred.clear();
+
+        if (isInitiator && ibltOptions && !ibltFailed && pendingOutputs.size()) {
+            currBound = ibltMarker();
+            encodeBound(w, currBound, lastTimestampOut);
+            w.varInt(0); // mode = Skip
+        }
+
+        uint64_t headerSize = output.size();
+
+        // An output that doesn't fit is left for the next frame, and this one filled with whatever fits after it (the
+        // receiver skips its range), until not even a Fingerprint would
+        auto defer = [&](uint64_t outputSize){
+            if (outputSize == headerSize || frameSizeLimit - outputSize < SplitPolicy::fingerprintBytes(idSize) + 8) return false;
+            deferred.push_back(pendingOutputs.back());
+            pendingOutputs.pop_back();
+            return true;
+        };
+
+        while (pendingOutputs.size()) {
+            auto &p = pendingOutputs.back();
+            auto start = loadBound(p.start);
+            if (start < currBound && output.size() == headerSize && start == XorElem(0, "")) start = currBound; // nothing precedes the marker
+            if (start < currBound) break;
+
+            uint64_t prevOutputSize = output.size();
+
+            // Don't bother rendering what certainly won't fit: at least its payload, plus an end bound and mode
+            if (frameSizeLimit && prevOutputSize + minOutputBytes(p) > frameSizeLimit) {
+                if (defer(prevOutputSize)) continue;
+                if (prevOutputSize > headerSize) break;
+            }
+
+            auto prevState = std::make_tuple(lastTimestampOut, currIndex, currIndexExact);
+
+            if (currBound != start) {
+                encodeBound(w, start, lastTimestampOut);
+                w.varInt(0); // mode = Skip
+                currIndexExact = false;
+            }
+
+            auto end = loadBound(p.end);
+            encodeBound(w, end, lastTimestampOut);
+
+            if (p.mode == 3) { // IdListResponse
+                w.bytes(std::string_view(payloadBuffer).substr(p.payloadOffset, p.payloadSize));
+                currIndexExact = false;
+            } else {
+                uint64_t lower = p.lower != NoIndex ? p.lower : currIndexExact ? currIndex : storage.findUpperBound(currIndex, storage.size(), start);
+                uint64_t upper = p.upper != NoIndex ? p.upper : storage.findUpperBound(lower, storage.size(), end);
+
+                if (p.mode == 1) {
+                    w.varInt(1); // mode = Fingerprint
+                    w.bytes(std::string_view(storage.fingerprint(lower, upper).id, idSize));
+                } else if (p.mode == 4) {
+                    w.varInt(4); // mode = IBLT
+                    auto &iblt = round->iblt;
+                    iblt.reset(p.payloadOffset);
+
+                    auto onItem = [&](const XorElem &item, uint64_t){
+                        iblt.add(item.id, 1);
+                    };
+
+                    storage.iterate(lower, upper, std::ref(onItem));
+                    iblt.encode(w);
+                } else {
+                    w.varInt(2); // mode = IdList
+                    w.varInt(upper - lower);
+
+                    if (auto packed = storage.packedIds(lower, upper, idSize); packed.size()) {
+                        if constexpr (std::is_same_v<Out, OutputSlices>) output.reference(packed);
+                        else w.bytes(packed);
+                    } else {
+                        auto onItem = [&](const XorElem &item, uint64_t){
+                            w.bytes(std::string_view(item.id, idSize));
+                        };
+
+                        storage.iterate(lower, upper, std::ref(onItem));
+                    }
+                }
+
+                currIndex = upper;
+                currIndexExact = true;
+            }
+
+            if (frameSizeLimit && output.size() > frameSizeLimit) {
+                output.resize(prevOutputSize);
+                std::tie(lastTimestampOut, currIndex, currIndexExact) = prevState;
+                if (defer(prevOutputSize)) continue;
+                break;
+            }
+
+            currBound = end;
+
+            pendingOutputs.pop_back();
+        }
+
+        pendingOutputs.insert(pendingOutputs.end(), deferred.rbegin(), deferred.rend());
+        if (output.size() == headerSize) output.clear();
+
+        compactPayloads();
+
+        if constexpr (std::is_same_v<Out, OutputSlices>) output.finish();
+    }
+
+    // Once sent, bounds and payloads are dead space in payloadBuffer. Reclaim it when nothing is pending, or
+    // when frame-limited sessions leave outputs queued and the dead space dominates.
+    void compactPayloads() {
+        if (pendingOutputs.empty()) {
+            payloadBuffer.clear();
+            return;
+        }
+
+        if (payloadBuffer.size() < 65536) return;
+
+        uint64_t liveBytes = 0;
+        for (const auto &p : pendingOutputs) liveBytes += boundSize(p.start) + boundSize(p.end) + p.payloadSize;
+        if (liveBytes * 2 > payloadBuffer.size()) return;
+
+        auto move = [&](uint64_t offset, uint64_t size){
+            compactionBuffer.append(payloadBuffer, offset, size);
+            return compactionBuffer.size() - size;
+        };
+
+        // Contiguous outputs share a bound: each one's end is usually the start of the one before it
+        uint64_t prevStart = MAX_U64, prevStartMoved = 0;
+        compactionBuffer.clear();
+
+        for (auto &p : pendingOutputs) {
+            uint64_t end = p.end == prevStart ? prevStartMoved : move(p.end, boundSize(p.end));
+            prevStart = p.start;
+            p.start = prevStartMoved = move(p.start, boundSize(p.start));
+            p.end = end;
+            if (p.payloadSize) p.payloadOffset = move(p.payloadOffset, p.payloadSize);
+        }
+
+        std::swap(payloadBuffer, compactionBuffer);
+    }
+
+    // Decoding
+
+    uint64_t decodeTimestampIn(Reader &reader, uint64_t &lastTimestampIn) {
+        uint64_t timestamp = reader.varInt();
+        timestamp = timestamp == 0 ? MAX_U64 : timestamp - 1;
+        timestamp += lastTimestampIn;
+        if (timestamp < lastTimestampIn) timestamp = MAX_U64; // saturate
+        lastTimestampIn = timestamp;
+        return timestamp;
+    }
+
+    XorElem decodeBound(Reader &reader, uint64_t &lastTimestampIn) {
+        auto timestamp = decodeTimestampIn(reader, lastTimestampIn);
+        auto len = reader.varInt();
+        return XorElem(timestamp, reader.bytes(len));
+    }
+
+
+    // Encoding
+
+    template <typename W>
+    void encodeTimestampOut(W &w, uint64_t timestamp, uint64_t &lastTimestampOut) {
+        if (timestamp == MAX_U64) {
+            lastTimestampOut = MAX_U64;
+            w.varInt(0);
+            return;
+        }
+
+        uint64_t temp = timestamp;
+        timestamp -= lastTimestampOut;
+        lastTimestampOut = temp;
+        w.varInt(timestamp + 1);
+    };
+
+    template <typename W>
+    void encodeBound(W &w, const XorElem &bound, uint64_t &lastTimestampOut) {
+        encodeTimestampOut(w, bound.timestamp, lastTimestampOut);
+        w.varInt(bound.idSize);
+        w.bytes(bound.getId(idSize));
+    };
+
+    XorElem getMinimalBound(const XorElem &prev, const XorElem &curr) {
+        if (curr.timestamp != prev.timestamp) {
+            return XorElem(curr.timestamp, "");
+        } else {
+            uint64_t sharedPrefixBytes = std::min(kernels::sharedPrefix32(prev.id, curr.id), idSize);
+            return XorElem(curr.timestamp, curr.getId().substr(0, sharedPrefixBytes + 1));
+        }
+    }
+
+    // Length-prefixed
+    template <typename W>
+    void encodeBitField(W &w, const std::pmr::vector<uint64_t> &inds) {
+        if (inds.size() == 0) {
+            w.varInt(0);
+            return;
+        }
+
+        uint64_t max = *std::max_element(inds.begin(), inds.end());
+        uint64_t bitFieldSize = (max + 8) / 8;
+        w.varInt(bitFieldSize);
+
+        uint64_t base = w.buf.size();
+        w.buf.append(bitFieldSize, '\0');
+        for (auto ind : inds) w.buf[base + ind / 8] |= 1 << ind % 8;
+    }
+
+    bool bitFieldLookup(std::string_view bitField, uint64_t ind) {
+        if ((ind + 8) / 8 > bitField.size()) return false;
+        return !!(bitField[ind / 8] & 1 << (ind % 8));
+    }
+};
+
+
+
+// Owns the items (or shares an external storage), and dispatches the protocol to a BasicNegentropy
+// instantiation for its idSize
+
+struct Negentropy {
+    uint64_t idSize;
+    std::shared_ptr<storage::Vector> ownStorage; // used by addItem()/seal() when no external storage is provided
+
+    // Protocol state is allocated from resource (see BasicNegentropy), but not the items themselves
+
+    Negentropy(uint64_t idSize, std::pmr::memory_resource *resource = std::pmr::get_default_resource()) : idSize(idSize), ownStorage(std::make_shared<storage::Vector>(idSize)), session(makeSession(idSize, ownStorage, resource)) {
+    }
+
+    // Reconcile directly against a caller-owned storage (which must outlive this object)
+    Negentropy(uint64_t idSize, const StorageBase &storage, std::pmr::memory_resource *resource = std::pmr::get_default_resource()) : Negentropy(idSize, std::shared_ptr<const StorageBase>(&storage, [](const StorageBase *){}), resource) {
+    }
+
+    // Sessions sharing one sealed storage don't copy it, and can run concurrently on different threads
+    Negentropy(uint64_t idSize, std::shared_ptr<const StorageBase> storage, std::pmr::memory_resource *resource = std::pmr::get_default_resource()) : idSize(idSize), session(makeSession(idSize, std::move(storage), resource)) {
+    }
+
+    void addItem(uint64_t createdAt, std::string_view id) {
+        if (!ownStorage) throw negentropy::err("can't add items to external storage");
+        ownStorage->addItem(createdAt, id);
+    }
+
+    void seal(uint64_t fingerprintIndexStride = 0) {
+        seal(SealOptions{ fingerprintIndexStride });
+    }
+
+    void seal(const SealOptions &opts) {
+        if (!ownStorage) throw negentropy::err("can't seal external storage");
+        ownStorage->seal(opts);
+    }
+
+    // Seals on a background thread: the object must not be used until the returned future is ready
+    std::future<void> sealAsync(const SealOptions &opts = SealOptions()) {
+        if (!ownStorage) throw negentropy::err("can't seal external storage");
+        return ownStorage->sealAsync(opts);
+    }
+
+    // See storage::Snapshot for opening the file again
+    void writeSnapshot(const std::string &path) const {
+        if (!ownStorage) throw negentropy::err("can't snapshot external storage");
+        ownStorage->writeSnapshot(path);
+    }
+
+    // The sealed items, for constructing other sessions
+    std::shared_ptr<const StorageBase> shareStorage() const {
+        if (ownStorage && !ownStorage->sealed) throw negentropy::err("not sealed");
+        return std::visit([](const auto &s){ return s.storagePtr; }, session);
+    }
+
+    const StorageBase &storage() const {
+        return std::visit([](const auto &s) -> const StorageBase & { return s.storage(); }, session);
+    }
+
+    // Clears all per-session protocol state so the object can be reused for a new session,
+    // optionally against a different storage
+    void reset() {
+        std::visit([](auto &s){ s.reset(); }, session);
+    }
+
+    void reset(std::shared_ptr<const StorageBase> storage) {
+        std::visit([&](auto &s){ s.reset(std::move(storage)); }, session);
+        ownStorage.reset();
+    }
+
+    void setSplitPolicy(std::shared_ptr<const SplitPolicy> policy) {
+        std::visit([&](auto &s){ s.setSplitPolicy(std::move(policy)); }, session);
+    }
+
+    void setIblt(std::optional<IbltOptions> options) {
+        std::visit([&](auto &s){ s.setIblt(options); }, session);
+    }
+
+    std::string initiate(uint64_t frameSizeLimit = 0) {
+        return std::visit([&](auto &s){ return s.initiate(frameSizeLimit); }, session);
+    }
+
+    std::string reconcile(std::string_view query) {
+        return std::visit([&](auto &s){ return s.reconcile(query); }, session);
+    }
+
+    std::string reconcile(std::string_view query, std::vector<std::string> &haveIds, std::vector<std::string> &needIds) {
+        return std::visit([&](auto &s){ return s.reconcile(query, haveIds, needIds); }, session);
+    }
+
+    std::string reconcile(std::string_view query, std::pmr::vector<std::pmr::string> &haveIds, std::pmr::vector<std::pmr::string> &needIds) {
+        return std::visit([&](auto &s){ return s.reconcile(query, haveIds, needIds); }, session);
+    }
+
+    std::string reconcile(std::string_view query, const IdCallback &onHave, const IdCallback &onNeed) {
+        return std::visit([&](auto &s){ return s.reconcile(query, onHave, onNeed); }, session);
+    }
+
+    void initiate(OutputSlices &output, uint64_t frameSizeLimit = 0) {
+        std::visit([&](auto &s){ s.initiate(output, frameSizeLimit); }, session);
+    }
+
+    void reconcile(std::string_view query, OutputSlices &output) {
+        std::visit([&](auto &s){ s.reconcile(query, output); }, session);
+    }
+
+    template <typename Have, typename Need>
+    void reconcile(std::string_view query, Have &&haveIds, Need &&needIds, OutputSlices &output) {
+        std::visit([&](auto &s){ s.reconcile(query, haveIds, needIds, output); }, session);
+    }
+
+  private:
+    using Session = std::variant<BasicNegentropy<16>, BasicNegentropy<32>, BasicNegentropy<8>, BasicNegentropy<0>>;
+
+    Session session;
+
+    static Session makeSession(uint64_t idSize, std::shared_ptr<const StorageBase> storage, std::pmr::memory_resource *resource) {
+        if (idSize == 16) return Session(std::in_place_type<BasicNegentropy<16>>, idSize, std::move(storage), resource);
+        if (idSize == 32) return Session(std::in_place_type<BasicNegentropy<32>>, idSize, std::move(storage), resource);
+        if (idSize == 8) return Session(std::in_place_type<BasicNegentropy<8>>, idSize, std::move(storage), resource);
+        return Session(std::in_place_type<BasicNegentropy<0>>, idSize, std::move(storage), resource);
+    }
+};
+
+
+
+// Thread-safe pool of reusable sessions that all reconcile against the same shared storage.
+// Sessions are reset and returned to the pool when the SessionPool::Handle is destroyed,
+// so the pool must outlive every handle it hands out.
+
+struct SessionPool {
+    struct Releaser {
+        SessionPool *pool;
+
+        void operator()(Negentropy *session) const {
+            pool->release(session);
+        }
+    };
+
+    using Handle = std::unique_ptr<Negentropy, Releaser>;
+
+    SessionPool(uint64_t idSize, std::shared_ptr<const StorageBase> storage) : idSize(idSize), storage(std::move(storage)) {
+        if (!this->storage) throw negentropy::err("null storage");
+    }
+
+    ~SessionPool() {
+        for (auto *session : freeSessions) delete session;
+    }
+
+    SessionPool(const SessionPool &) = delete;
+    SessionPool &operator=(const SessionPool &) = delete;
+
+    Handle acquire() {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        if (freeSessions.empty()) {
+            auto currStorage = storage;
+            lock.unlock();
+            return Handle(new Negentropy(idSize, std::move(currStorage)), Releaser{this});
+        }
+
+        auto *session = freeSessions.back();
+        freeSessions.pop_back();
+        if (&session->storage() != storage.get()) session->reset(storage);
+
+        return Handle(session, Releaser{this});
+    }
+
+    // Sessions acquired after this call reconcile against the new storage
+    void setStorage(std::shared_ptr<const StorageBase> newStorage) {
+        if (!newStorage) throw negentropy::err("null storage");
+        std::lock_guard<std::mutex> lock(mutex);
+        storage = std::move(newStorage);
+    }
+
+  private:
+    uint64_t idSize;
+    std::mutex mutex;
+    std::shared_ptr<const StorageBase> storage;
+    std::vector<Negentropy *> freeSessions;
+
+    void release(Negentropy *session) {
+        session->reset();
+        std::lock_guard<std::mutex> lock(mutex);
+        freeSessions.push_back(session);
+    }
+};
 
 }
 
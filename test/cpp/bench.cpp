@@ -0,0 +1,486 @@
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <atomic>
+#include <new>
+#include <memory_resource>
+
+#include "Negentropy.h"
+
+
+
+using namespace negentropy;
+
+// Count heap allocations, to measure them per message
+
+static std::atomic<uint64_t> numAllocations = 0;
+
+// Kept out of line, so that GCC doesn't pair the inlined free() with operator new and warn about a mismatch
+[[gnu::noinline]] static void *countedAlloc(size_t size, size_t alignment = 0) {
+    numAllocations.fetch_add(1, std::memory_order_relaxed);
+    if (!size) size = 1;
+    void *p = alignment ? ::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment) : ::malloc(size);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+[[gnu::noinline]] static void countedFree(void *p) noexcept {
+    ::free(p);
+}
+
+void *operator new(size_t size) { return countedAlloc(size); }
+void *operator new[](size_t size) { return countedAlloc(size); }
+void *operator new(size_t size, std::align_val_t al) { return countedAlloc(size, static_cast<size_t>(al)); }
+void *operator new[](size_t size, std::align_val_t al) { return countedAlloc(size, static_cast<size_t>(al)); }
+
+void operator delete(void *p) noexcept { countedFree(p); }
+void operator delete[](void *p) noexcept { countedFree(p); }
+void operator delete(void *p, size_t) noexcept { countedFree(p); }
+void operator delete[](void *p, size_t) noexcept { countedFree(p); }
+void operator delete(void *p, std::align_val_t) noexcept { countedFree(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { countedFree(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept { countedFree(p); }
+void operator delete[](void *p, size_t, std::align_val_t) noexcept { countedFree(p); }
+
+static std::mt19937_64 rng(1);
+
+static std::string randomId(uint64_t idSize) {
+    std::string id(idSize, '\0');
+    for (auto &c : id) c = static_cast<char>(rng());
+    return id;
+}
+
+template<typename F>
+static double nsPerOp(uint64_t ops, F fn) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / ops;
+}
+
+static void report(const std::string &name, uint64_t numItems, double ns) {
+    std::cout << std::left << std::setw(32) << name << std::right << std::setw(10) << numItems << std::setw(12) << std::fixed << std::setprecision(1) << ns << " ns/op" << std::endl;
+}
+
+static uint64_t sink = 0;
+
+
+
+// Bound lookups, as performed by reconcileAux: random probes over the whole set, and ascending
+// probes that resume from the previous position
+
+static void benchBoundLookups(uint64_t numItems) {
+    const uint64_t idSize = 16;
+    const uint64_t numLookups = 1'000'000;
+
+    storage::Vector withIndex(idSize), withoutIndex(idSize);
+
+    for (uint64_t i = 0; i < numItems; i++) {
+        uint64_t timestamp = rng() % (numItems * 4);
+        auto id = randomId(idSize);
+        withIndex.addItem(timestamp, id);
+        withoutIndex.addItem(timestamp, id);
+    }
+
+    SealOptions opts;
+    withIndex.seal(opts);
+    opts.searchIndex = false;
+    withoutIndex.seal(opts);
+
+    std::vector<XorElem> bounds;
+    for (uint64_t i = 0; i < numLookups; i++) bounds.emplace_back(rng() % (numItems * 4), randomId(idSize));
+
+    std::vector<XorElem> ascending = bounds;
+    std::sort(ascending.begin(), ascending.end());
+
+    for (auto *storage : { &withIndex, &withoutIndex }) {
+        std::string suffix = storage == &withIndex ? " (index)" : " (binary)";
+        auto view = storage->view();
+
+        report("random lookup" + suffix, numItems, nsPerOp(numLookups, [&]{
+            for (const auto &b : bounds) sink += view.findUpperBound(0, numItems, b);
+        }));
+
+        report("ascending lookup" + suffix, numItems, nsPerOp(numLookups, [&]{
+            uint64_t prev = 0;
+            for (const auto &b : ascending) sink += prev = view.findUpperBound(prev, numItems, b);
+        }));
+    }
+}
+
+
+
+// Range-fingerprint XOR kernels over packed ids, compared to a plain byte loop
+
+static void xorByteLoop(char *accum, const char *p, uint64_t n, uint64_t idSize) {
+    for (uint64_t i = 0; i < n; i++, p += idSize) {
+        for (size_t j = 0; j < idSize; j++) accum[j] ^= p[j];
+    }
+}
+
+static void benchXorKernels(uint64_t numItems) {
+    std::vector<std::pair<std::string, kernels::XorPackedIdsFn>> variants = {
+        { "byte loop", xorByteLoop },
+        { "portable", kernels::xorPackedIdsPortable },
+#ifdef NEGENTROPY_X86_KERNELS
+        { "sse2", kernels::xorPackedIdsSse2 },
+#endif
+    };
+
+#ifdef NEGENTROPY_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) variants.emplace_back("avx2", kernels::xorPackedIdsAvx2);
+    if (__builtin_cpu_supports("avx512f")) variants.emplace_back("avx512", kernels::xorPackedIdsAvx512);
+#endif
+
+    for (uint64_t idSize : { 8, 16, 32 }) {
+        auto ids = randomId(numItems * idSize);
+        uint64_t reps = std::max(uint64_t(1), 50'000'000 / numItems);
+
+        for (const auto &[name, fn] : variants) {
+            char accum[32] = {};
+
+            report("xor " + name + " (idSize " + std::to_string(idSize) + ")", numItems, nsPerOp(reps * numItems, [&]{
+                for (uint64_t r = 0; r < reps; r++) fn(accum, ids.data(), numItems, idSize);
+            }));
+
+            sink += accum[0];
+        }
+    }
+}
+
+
+
+// Bucket-boundary generation in splitRange (getMinimalBound on adjacent items sharing timestamps), and
+// ordering comparisons that are not decided by the id key, compared to the byte-at-a-time originals
+
+static XorElem minimalBoundByteLoop(const XorElem &prev, const XorElem &curr, uint64_t idSize) {
+    if (curr.timestamp != prev.timestamp) return XorElem(curr.timestamp, "");
+
+    uint64_t sharedPrefixBytes = 0;
+    auto currKey = curr.getId();
+    auto prevKey = prev.getId();
+
+    for (uint64_t i = 0; i < idSize; i++) {
+        if (currKey[i] != prevKey[i]) break;
+        sharedPrefixBytes++;
+    }
+
+    return XorElem(curr.timestamp, currKey.substr(0, sharedPrefixBytes + 1));
+}
+
+static XorElem minimalBoundSimd(const XorElem &prev, const XorElem &curr, uint64_t idSize) {
+    if (curr.timestamp != prev.timestamp) return XorElem(curr.timestamp, "");
+
+    uint64_t sharedPrefixBytes = std::min(kernels::sharedPrefix32(prev.id, curr.id), idSize);
+    return XorElem(curr.timestamp, curr.getId().substr(0, sharedPrefixBytes + 1));
+}
+
+static bool lessStringView(const XorElem &a, const XorElem &b) {
+    if (a.timestamp != b.timestamp) return a.timestamp < b.timestamp;
+    if (a.idKey != b.idKey) return a.idKey < b.idKey;
+    return a.getId() < b.getId();
+}
+
+static void benchBoundaries(uint64_t numItems) {
+    const uint64_t idSize = 32;
+
+    // Few distinct timestamps (none, for the comparisons), and ids sharing a 12-byte prefix, so neither
+    // decides most comparisons
+    std::vector<XorElem> items;
+    auto prefix = randomId(12);
+    for (uint64_t i = 0; i < numItems; i++) items.emplace_back(rng() % 16, prefix + randomId(idSize - 12));
+    std::sort(items.begin(), items.end());
+
+    for (auto [name, fn] : { std::make_pair("byte loop", minimalBoundByteLoop), std::make_pair("simd", minimalBoundSimd) }) {
+        report(std::string("minimal bound ") + name, numItems, nsPerOp(numItems - 1, [&]{
+            for (uint64_t i = 1; i < numItems; i++) sink += fn(items[i - 1], items[i], idSize).idSize;
+        }));
+    }
+
+    for (auto &item : items) item.timestamp = 0;
+    auto shuffled = items;
+    std::shuffle(shuffled.begin(), shuffled.end(), rng);
+
+    report("compare string_view", numItems, nsPerOp(numItems, [&]{
+        for (uint64_t i = 0; i < numItems; i++) sink += lessStringView(shuffled[i], items[i]);
+    }));
+
+    report("compare simd", numItems, nsPerOp(numItems, [&]{
+        for (uint64_t i = 0; i < numItems; i++) sink += shuffled[i] < items[i];
+    }));
+}
+
+
+
+// Full reconciliations of two sets differing in 0.1% of their items, against each storage backend
+
+struct AllocationStats {
+    uint64_t messages = 0;
+    uint64_t clientAllocations = 0;
+    uint64_t serverAllocations = 0;
+};
+
+template <typename Session, typename IdVector = std::vector<std::string>>
+static uint64_t reconcile(Session &client, Session &server, AllocationStats &stats, IdVector have = IdVector(), IdVector need = IdVector()) {
+    uint64_t before = numAllocations;
+    std::string msg = client.initiate();
+    stats.clientAllocations += numAllocations - before;
+
+    while (msg.size()) {
+        before = numAllocations;
+        msg = server.reconcile(msg);
+        stats.serverAllocations += numAllocations - before;
+
+        before = numAllocations;
+        msg = client.reconcile(msg, have, need);
+        stats.clientAllocations += numAllocations - before;
+
+        stats.messages++;
+    }
+
+    if constexpr (std::is_invocable_v<IdVector &, std::string_view>) return 0;
+    else return have.size() + need.size();
+}
+
+static void benchReconcile(uint64_t numItems) {
+    const uint64_t idSize = 16;
+
+    Negentropy client(idSize), server(idSize);
+    uint64_t timestamp = 1'600'000'000;
+
+    for (uint64_t i = 0; i < numItems; i++) {
+        timestamp += rng() % 3;
+        auto id = randomId(idSize);
+        uint64_t r = rng() % 2000;
+        if (r != 0) client.addItem(timestamp, id);
+        if (r != 1) server.addItem(timestamp, id);
+    }
+
+    client.seal();
+    server.seal();
+
+    AllocationStats warmup, stats;
+    reconcile(client, server, warmup);
+
+    report("reconcile vector (per item)", numItems, nsPerOp(numItems, [&]{ sink += reconcile(client, server, stats); }));
+
+    std::cout << "    allocations per message: server " << std::setprecision(1) << double(stats.serverAllocations) / stats.messages
+              << ", client (including have/need ids) " << double(stats.clientAllocations) / stats.messages << std::endl;
+
+    // Sessions and have/need ids allocating from per-thread pools, as a server running many sessions would
+    std::pmr::unsynchronized_pool_resource clientPool, serverPool;
+    Negentropy clientPmr(idSize, client.shareStorage(), &clientPool), serverPmr(idSize, server.shareStorage(), &serverPool);
+    using PmrIds = std::pmr::vector<std::pmr::string>;
+    AllocationStats pmrStats;
+    reconcile(clientPmr, serverPmr, warmup, PmrIds(&clientPool), PmrIds(&clientPool));
+
+    report("reconcile pmr pools (per item)", numItems, nsPerOp(numItems, [&]{ sink += reconcile(clientPmr, serverPmr, pmrStats, PmrIds(&clientPool), PmrIds(&clientPool)); }));
+
+    std::cout << "    allocations per message: server " << std::setprecision(1) << double(pmrStats.serverAllocations) / pmrStats.messages
+              << ", client " << double(pmrStats.clientAllocations) / pmrStats.messages << std::endl;
+
+    // Have/need ids streamed to a callback instead of collected
+    AllocationStats callbackStats;
+    IdCallback onId = [&](std::string_view id){ sink += id[0]; };
+
+    report("reconcile callbacks (per item)", numItems, nsPerOp(numItems, [&]{ reconcile(client, server, callbackStats, onId, onId); }));
+
+    std::cout << "    allocations per message: client " << std::setprecision(1) << double(callbackStats.clientAllocations) / callbackStats.messages << std::endl;
+
+    BasicNegentropy<0> clientDynamic(idSize, client.shareStorage()), serverDynamic(idSize, server.shareStorage());
+    report("reconcile runtime idSize", numItems, nsPerOp(numItems, [&]{ sink += reconcile(clientDynamic, serverDynamic, stats); }));
+
+    storage::Compressed clientCompressed(idSize, client.storage()), serverCompressed(idSize, server.storage());
+    Negentropy client2(idSize, clientCompressed), server2(idSize, serverCompressed);
+
+    report("reconcile compressed (per item)", numItems, nsPerOp(numItems, [&]{ sink += reconcile(client2, server2, stats); }));
+
+    std::cout << "    compressed: " << std::setprecision(2) << double(serverCompressed.memoryUsage()) / serverCompressed.size() << " bytes/item, vector: " << 8 + idSize << " bytes/item" << std::endl;
+}
+
+
+
+// Round trips and bytes with the default, adaptive, recency, and speculative split policies, and with the default
+// one plus the IBLT mode, for a handful of differences, for differences in 20% of the items, and for differences
+// only among the 100 newest items (checking that recency resolves those in one round trip, and the others in no
+// more than the default)
+
+static void benchSplitPolicies(uint64_t numItems) {
+    const uint64_t idSize = 16;
+
+    for (auto label : { "sparse", "dense", "recent" }) {
+        Negentropy client(idSize), server(idSize);
+        uint64_t numDiffs = label == std::string("sparse") ? 10 : label == std::string("dense") ? numItems / 5 : 50;
+
+        for (uint64_t i = 0; i < numItems; i++) {
+            auto id = randomId(idSize);
+            uint64_t timestamp = rng() % (numItems * 4);
+            bool differs = label == std::string("recent") ? i >= numItems - 100 && rng() % 2 : rng() % numItems < numDiffs;
+            if (label == std::string("recent")) timestamp = i * 4 + rng() % 4;
+            bool onClient = !differs || rng() % 2;
+            if (onClient) client.addItem(timestamp, id);
+            if (!differs || !onClient) server.addItem(timestamp, id);
+        }
+
+        client.seal();
+        server.seal();
+
+        uint64_t fixedRoundTrips = 0;
+
+        for (auto policyName : { "fixed 16", "adaptive", "recency", "speculative", "iblt" }) {
+            std::shared_ptr<SplitPolicy> policy;
+            if (policyName == std::string("adaptive")) policy = std::make_shared<AdaptiveSplitPolicy>();
+            else if (policyName == std::string("recency")) policy = std::make_shared<RecencySplitPolicy>();
+            else if (policyName == std::string("speculative")) policy = std::make_shared<SpeculativeSplitPolicy>(nullptr, 2, 1 << 20);
+            client.setSplitPolicy(policy);
+            server.setSplitPolicy(policy);
+
+            std::optional<IbltOptions> iblt;
+            if (policyName == std::string("iblt")) iblt = IbltOptions{};
+            client.setIblt(iblt);
+            server.setIblt(iblt);
+
+            uint64_t roundTrips = 0, bytes = 0;
+            std::vector<std::string> have, need;
+
+            double ns = nsPerOp(numItems, [&]{
+                std::string msg = client.initiate();
+
+                while (msg.size()) {
+                    bytes += msg.size();
+                    msg = server.reconcile(msg);
+                    bytes += msg.size();
+                    msg = client.reconcile(msg, have, need);
+                    roundTrips++;
+                }
+            });
+
+            report(std::string(label) + " " + policyName + " (per item)", numItems, ns);
+            std::cout << "    " << roundTrips << " round trips, " << bytes << " bytes" << std::endl;
+
+            // The README's claims for RecencySplitPolicy: differences among the newest items take one round trip,
+            // and differences spread uniformly take no more than with the default split
+            if (policyName == std::string("fixed 16")) fixedRoundTrips = roundTrips;
+
+            if (label == std::string("recent") && policyName == std::string("recency") && roundTrips != 1) {
+                throw negentropy::err("recency took " + std::to_string(roundTrips) + " round trips for recent differences");
+            }
+
+            if (label != std::string("recent") && policyName == std::string("recency") && roundTrips > fixedRoundTrips) {
+                throw negentropy::err("recency took " + std::to_string(roundTrips) + " round trips for " + label + " differences, fixed 16 " + std::to_string(fixedRoundTrips));
+            }
+        }
+    }
+}
+
+
+
+// Server responses to a client whose set differs in 10% of its items, built as strings and as slices referencing
+// the sealed ids. The client's frames are limited to 4 KB, so it sends Fingerprints of buckets small enough for the
+// server to answer with IdLists, which are what get referenced (checking that some are).
+
+static void benchOutputSlices(uint64_t numItems) {
+    const uint64_t idSize = 32;
+
+    Negentropy client(idSize), server(idSize);
+
+    for (uint64_t i = 0; i < numItems; i++) {
+        auto id = randomId(idSize);
+        uint64_t timestamp = rng() % (numItems * 4);
+        if (rng() % 10 != 0) client.addItem(timestamp, id);
+        server.addItem(timestamp, id);
+    }
+
+    client.seal();
+    server.seal();
+
+    // Record the client's messages once, then replay them to the server
+    std::vector<std::string> queries;
+    std::vector<std::string> have, need;
+    std::string msg = client.initiate(4096);
+
+    while (msg.size()) {
+        queries.push_back(msg);
+        msg = client.reconcile(server.reconcile(msg), have, need);
+    }
+
+    uint64_t responseBytes = 0, referencedBytes = 0;
+
+    report("responses as strings (per item)", numItems, nsPerOp(numItems, [&]{
+        for (const auto &q : queries) responseBytes += server.reconcile(q).size();
+    }));
+
+    negentropy::OutputSlices slices;
+
+    report("responses as slices (per item)", numItems, nsPerOp(numItems, [&]{
+        for (const auto &q : queries) {
+            server.reconcile(q, slices);
+            referencedBytes += slices.size() - slices.buffer.size();
+        }
+    }));
+
+    std::cout << "    ids referenced in place: " << std::setprecision(1) << 100.0 * referencedBytes / responseBytes << "% of response bytes" << std::endl;
+
+    if (referencedBytes == 0) throw negentropy::err("no ids were referenced in place");
+}
+
+
+
+// Round trips for a client whose messages are frame-limited, with differences in 5% of the items, and how full its
+// frames are on average
+
+static void benchFrameLimit(uint64_t numItems) {
+    const uint64_t idSize = 16;
+
+    Negentropy client(idSize), server(idSize);
+
+    for (uint64_t i = 0; i < numItems; i++) {
+        auto id = randomId(idSize);
+        uint64_t timestamp = rng() % (numItems * 4);
+        bool differs = rng() % 20 == 0;
+        bool onClient = !differs || rng() % 2;
+        if (onClient) client.addItem(timestamp, id);
+        if (!differs || !onClient) server.addItem(timestamp, id);
+    }
+
+    client.seal();
+    server.seal();
+
+    for (uint64_t frameSizeLimit : { 4096, 65536 }) {
+        uint64_t roundTrips = 0, clientBytes = 0;
+        std::vector<std::string> have, need;
+
+        double ns = nsPerOp(numItems, [&]{
+            std::string msg = client.initiate(frameSizeLimit);
+
+            while (msg.size()) {
+                clientBytes += msg.size();
+                msg = client.reconcile(server.reconcile(msg), have, need);
+                roundTrips++;
+            }
+        });
+
+        report("frame limit " + std::to_string(frameSizeLimit) + " (per item)", numItems, ns);
+        std::cout << "    " << roundTrips << " round trips, frames " << std::setprecision(0) << 100.0 * clientBytes / (roundTrips * frameSizeLimit) << "% full" << std::endl;
+    }
+}
+
+
+
+int main(int argc, char **argv) {
+    uint64_t maxItems = argc > 1 ? std::stoull(argv[1]) : 10'000'000;
+
+    for (uint64_t numItems = 1'000; numItems <= maxItems; numItems *= 10) benchBoundLookups(numItems);
+    for (uint64_t numItems = 1'000; numItems <= maxItems; numItems *= 10) benchXorKernels(numItems);
+    for (uint64_t numItems = 1'000; numItems <= maxItems; numItems *= 10) benchBoundaries(numItems);
+    for (uint64_t numItems = 1'000; numItems <= maxItems; numItems *= 10) benchReconcile(numItems);
+    for (uint64_t numItems = 1'000; numItems <= maxItems; numItems *= 10) benchOutputSlices(numItems);
+    for (uint64_t numItems = 1'000; numItems <= maxItems; numItems *= 10) benchSplitPolicies(numItems);
+    for (uint64_t numItems = 1'000; numItems <= maxItems; numItems *= 10) benchFrameLimit(numItems);
+
+    std::cerr << "(checksum " << sink << ")" << std::endl;
+
+    return 0;
+}
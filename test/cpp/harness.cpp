@@ -1,3 +1,4 @@
+#include <fstream>
 #include <iostream>
 #include <sstream>
 
@@ -25,9 +26,48 @@ std::vector<std::string> split(const std::string &s, char delim) {
 int main() {
     const uint64_t idSize = 16;
 
+    // STORAGE=btree reconciles against incrementally-built B-trees instead of sealed vectors
+    // BTREECHURN=1 (with STORAGE=btree) erases and re-inserts a share of each tree's items before every round
+    // STORAGE=snapshot round-trips the sealed vectors through memory-mapped snapshot files
+    // STORAGE=compressed copies the sealed vectors into block-compressed stores
+    // STORAGE=layered inserts into LSM-style layered stores with a tiny delta, so there are many levels
+    // LIVEINGEST=1 (with STORAGE=layered) keeps inserting items into both stores while the session runs
+    std::string storageType = ::getenv("STORAGE") ? ::getenv("STORAGE") : "vector";
+    bool useBTree = storageType == "btree";
+    bool useLayered = storageType == "layered";
+    negentropy::storage::BTree t1, t2;
+    std::unique_ptr<negentropy::storage::Layered> l1, l2;
+
+    if (useLayered) {
+        negentropy::storage::LayeredOptions opts;
+        opts.deltaLimit = 64;
+        l1 = std::make_unique<negentropy::storage::Layered>(idSize, opts);
+        l2 = std::make_unique<negentropy::storage::Layered>(idSize, opts);
+    }
+
     // x1 is client, x2 is server
-    Negentropy x1(idSize);
-    Negentropy x2(idSize);
+    Negentropy x1 = useBTree ? Negentropy(idSize, t1) : Negentropy(idSize);
+    Negentropy x2 = useBTree ? Negentropy(idSize, t2) : Negentropy(idSize);
+
+    bool btreeChurn = useBTree && ::getenv("BTREECHURN") && std::string(::getenv("BTREECHURN")) == "1";
+
+    // SEALTHREADS=n (with sealed vectors) adds every item twice, along with enough common filler items (also twice)
+    // for the sort to use n threads, and seals with dedup on n threads
+    unsigned sealThreads = !useBTree && !useLayered && ::getenv("SEALTHREADS") ? std::stoul(::getenv("SEALTHREADS")) : 0;
+
+    // Items added to each side, for the modes that add them again
+    std::vector<std::pair<uint64_t, std::string>> items1, items2;
+
+    auto add = [&](Negentropy &x, negentropy::storage::BTree &t, std::unique_ptr<negentropy::storage::Layered> &l, uint64_t created, const std::string &id) {
+        if (useBTree) {
+            if (t.insert(created, id) && btreeChurn) (&t == &t1 ? items1 : items2).emplace_back(created, id);
+        } else if (useLayered) {
+            l->insert(created, id);
+        } else {
+            x.addItem(created, id);
+            if (sealThreads) (&x == &x1 ? items1 : items2).emplace_back(created, id);
+        }
+    };
 
     std::string line;
     while (std::cin) {
@@ -43,33 +83,196 @@ int main() {
         if (id.size() != idSize) throw hoytech::error("unexpected id size");
 
         if (mode == 1) {
-            x1.addItem(created, id);
+            add(x1, t1, l1, created, id);
         } else if (mode == 2) {
-            x2.addItem(created, id);
+            add(x2, t2, l2, created, id);
         } else if (mode == 3) {
-            x1.addItem(created, id);
-            x2.addItem(created, id);
+            add(x1, t1, l1, created, id);
+            add(x2, t2, l2, created, id);
         } else {
             throw hoytech::error("unexpected mode");
         }
     }
 
-    x1.seal();
-    x2.seal();
+    uint64_t fingerprintIndexStride = 0;
+    if (::getenv("FINGERPRINTINDEXSTRIDE")) fingerprintIndexStride = std::stoull(::getenv("FINGERPRINTINDEXSTRIDE"));
+
+    if (useLayered) {
+        x1 = Negentropy(idSize, l1->pin());
+        x2 = Negentropy(idSize, l2->pin());
+    } else if (sealThreads) {
+        // Twice as many items as storage::Vector's MinItemsPerSortThread per thread, counting the duplicates
+        uint64_t numItems = std::max(items1.size(), items2.size());
+        uint64_t numFiller = numItems < sealThreads * (1 << 15) ? sealThreads * (1 << 15) - numItems : 0;
+
+        for (uint64_t i = 0; i < numFiller; i++) {
+            std::string id(idSize, '\0');
+            for (uint64_t b = 0; b < idSize; b++) id[b] = static_cast<char>(((i * idSize + b + 1) * 0x9E3779B97F4A7C15ULL) >> 56);
+            uint64_t created = 1677970534 + i % 20000;
+            add(x1, t1, l1, created, id);
+            add(x2, t2, l2, created, id);
+        }
+
+        for (auto [x, items] : { std::pair(&x1, &items1), std::pair(&x2, &items2) }) {
+            for (const auto &[created, id] : *items) x->addItem(created, id);
+            x->seal(negentropy::SealOptions{ fingerprintIndexStride, true, sealThreads });
+            if (x->storage().size() != items->size()) throw hoytech::error("dedup kept duplicates or dropped items");
+        }
+    } else if (!useBTree) {
+        x1.seal(fingerprintIndexStride);
+        x2.seal(fingerprintIndexStride);
+    }
+
+    std::unique_ptr<negentropy::storage::Snapshot> snap1, snap2;
+
+    if (storageType == "snapshot") {
+        std::string prefix = "harness-snapshot-" + std::to_string(::getpid());
+        x1.writeSnapshot(prefix + "-1");
+        x2.writeSnapshot(prefix + "-2");
+        snap1 = std::make_unique<negentropy::storage::Snapshot>(prefix + "-1");
+        snap2 = std::make_unique<negentropy::storage::Snapshot>(prefix + "-2");
+
+        // A copy with its last byte flipped must be rejected, unless verification is turned off
+        if (x1.storage().size()) {
+            x1.writeSnapshot(prefix + "-c");
+            {
+                std::fstream f(prefix + "-c", std::ios::in | std::ios::out | std::ios::binary);
+                f.seekg(-1, std::ios::end);
+                char c = static_cast<char>(f.get() ^ 1);
+                f.seekp(-1, std::ios::end);
+                f.put(c);
+            }
+
+            bool rejected = false;
+            try {
+                negentropy::storage::Snapshot corrupted(prefix + "-c");
+            } catch (const negentropy::err &) {
+                rejected = true;
+            }
+            if (!rejected) throw hoytech::error("corrupted snapshot was accepted");
+
+            negentropy::storage::Snapshot unverified(prefix + "-c", false);
+            ::unlink((prefix + "-c").c_str());
+        }
+
+        ::unlink((prefix + "-1").c_str());
+        ::unlink((prefix + "-2").c_str());
+        x1 = Negentropy(idSize, *snap1);
+        x2 = Negentropy(idSize, *snap2);
+    }
+
+    std::unique_ptr<negentropy::storage::Compressed> comp1, comp2;
+
+    if (storageType == "compressed") {
+        comp1 = std::make_unique<negentropy::storage::Compressed>(idSize, x1.storage());
+        comp2 = std::make_unique<negentropy::storage::Compressed>(idSize, x2.storage());
+        x1 = Negentropy(idSize, *comp1);
+        x2 = Negentropy(idSize, *comp2);
+    }
+
+    // SESSIONPOOL=1 answers each client message with a fresh session from a pool sharing x2's storage
+    bool useSessionPool = ::getenv("SESSIONPOOL") && std::string(::getenv("SESSIONPOOL")) == "1";
+    negentropy::SessionPool pool(idSize, x2.shareStorage());
+
+    // SLICES=1 builds every message as negentropy::OutputSlices, and joins the slices before sending it
+    bool useSlices = ::getenv("SLICES") && std::string(::getenv("SLICES")) == "1";
+    negentropy::OutputSlices slices;
+
+    // CALLBACKS=1 prints the client's have/need ids from callbacks as they are found, instead of collecting them
+    bool useCallbacks = ::getenv("CALLBACKS") && std::string(::getenv("CALLBACKS")) == "1";
+    auto onHave = [](std::string_view id){ std::cout << "xor,HAVE," << hoytech::to_hex(id) << "\n"; };
+    auto onNeed = [](std::string_view id){ std::cout << "xor,NEED," << hoytech::to_hex(id) << "\n"; };
+
+    // SPLITPOLICY=adaptive splits differing ranges with an AdaptiveSplitPolicy on both sides
+    // SPLITPOLICY=recency uses a RecencySplitPolicy instead
+    // SPLITPOLICY=speculative sends two extra levels of the default split in each message
+    std::string splitPolicy = ::getenv("SPLITPOLICY") ? ::getenv("SPLITPOLICY") : "";
+    std::shared_ptr<const negentropy::SplitPolicy> policy;
+    if (splitPolicy == "adaptive") policy = std::make_shared<negentropy::AdaptiveSplitPolicy>();
+    else if (splitPolicy == "recency") policy = std::make_shared<negentropy::RecencySplitPolicy>();
+    else if (splitPolicy == "speculative") policy = std::make_shared<negentropy::SpeculativeSplitPolicy>(nullptr, 2);
+    if (policy) {
+        x1.setSplitPolicy(policy);
+        x2.setSplitPolicy(policy);
+    }
+
+    // IBLT=1 enables the IBLT mode on both sides
+    bool useIblt = ::getenv("IBLT") && std::string(::getenv("IBLT")) == "1";
+    if (useIblt) {
+        x1.setIblt(negentropy::IbltOptions{});
+        x2.setIblt(negentropy::IbltOptions{});
+    }
+
+    bool liveIngest = useLayered && ::getenv("LIVEINGEST") && std::string(::getenv("LIVEINGEST")) == "1";
+    uint64_t numIngested1 = 0, numIngested2 = 0;
+    uint64_t initialSize1 = useLayered ? l1->pin()->size() : 0, initialSize2 = useLayered ? l2->pin()->size() : 0;
+
+    // New items for both stores, which the pinned versions the session uses must not see. Enough per round for the
+    // delta to be sealed several times and levels to be merged underneath the session.
+    auto ingest = [&]{
+        static uint64_t counter = 0;
+
+        for (uint64_t i = 0; i < 300; i++) {
+            std::string id(idSize, '\0');
+            for (uint64_t b = 0; b < idSize; b++) id[b] = static_cast<char>((++counter * 0x9E3779B97F4A7C15ULL) >> 56);
+            uint64_t created = counter % 2'000'000'000;
+            if (l1->insert(created, id)) numIngested1++;
+            if (l2->insert(created, id)) numIngested2++;
+        }
+    };
+
+    // Every other item from an offset that changes each round is erased, and once the trees have been rebalanced
+    // around the gaps, put back. The sets are unchanged, so the fingerprints and the reconciliation must be too.
+    auto churn = [&](negentropy::storage::BTree &t, const std::vector<std::pair<uint64_t, std::string>> &items, uint64_t round) {
+        auto before = t.fingerprint(0, t.size());
+
+        for (uint64_t i = round % 2; i < items.size(); i += 2) {
+            if (!t.erase(items[i].first, items[i].second)) throw hoytech::error("btree erase failed");
+        }
+
+        for (uint64_t i = round % 2; i < items.size(); i += 2) {
+            if (!t.insert(items[i].first, items[i].second)) throw hoytech::error("btree re-insert failed");
+        }
+
+        if (t.size() != items.size() || t.fingerprint(0, t.size()).getId() != before.getId()) throw hoytech::error("btree changed by churn");
+    };
 
     std::string q;
     uint64_t round = 0;
 
     while (1) {
+        if (liveIngest) ingest();
+
+        if (btreeChurn) {
+            churn(t1, items1, round);
+            churn(t2, items2, round);
+        }
+
         // CLIENT -> SERVER
 
         if (round == 0) {
             uint64_t frameSizeLimit = 0;
             if (::getenv("FRAMESIZELIMIT")) frameSizeLimit = std::stoull(::getenv("FRAMESIZELIMIT"));
-            q = x1.initiate(frameSizeLimit);
+            if (useSlices) {
+                x1.initiate(slices, frameSizeLimit);
+                q = slices.str();
+            } else {
+                q = x1.initiate(frameSizeLimit);
+            }
         } else {
             std::vector<std::string> have, need;
-            q = x1.reconcile(q, have, need);
+
+            if (useCallbacks && useSlices) {
+                x1.reconcile(q, onHave, onNeed, slices);
+                q = slices.str();
+            } else if (useCallbacks) {
+                q = x1.reconcile(q, onHave, onNeed);
+            } else if (useSlices) {
+                x1.reconcile(q, have, need, slices);
+                q = slices.str();
+            } else {
+                q = x1.reconcile(q, have, need);
+            }
 
             for (auto &id : have) std::cout << "xor,HAVE," << hoytech::to_hex(id) << "\n";
             for (auto &id : need) std::cout << "xor,NEED," << hoytech::to_hex(id) << "\n";
@@ -81,7 +284,16 @@ int main() {
 
         // SERVER -> CLIENT
 
-        q = x2.reconcile(q);
+        if (useSessionPool) {
+            auto session = pool.acquire();
+            if (useIblt) session->setIblt(negentropy::IbltOptions{});
+            q = session->reconcile(q);
+        } else if (useSlices) {
+            x2.reconcile(q, slices);
+            q = slices.str();
+        } else {
+            q = x2.reconcile(q);
+        }
 
         std::cerr << "[" << round << "] SERVER -> CLIENT: " << q.size() << " bytes" << std::endl;
 
@@ -89,5 +301,9 @@ int main() {
         round++;
     }
 
+    if (liveIngest && (l1->pin()->size() != initialSize1 + numIngested1 || l2->pin()->size() != initialSize2 + numIngested2)) {
+        throw hoytech::error("items ingested during the session are missing");
+    }
+
     return 0;
 }